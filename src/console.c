@@ -0,0 +1,342 @@
+#include <stdint.h>
+#include <string.h>
+#include <chopstx.h>
+#include <eventflag.h>
+
+#include "config.h"
+
+#include "usb_conf.h"
+#include "usb_hid.h"
+#include "sun_usart.h"
+#include "sun_usart_stats.h"
+#include "serial.h"
+#include "mouse_accel.h"
+#include "mouse_scroll.h"
+#include "stackmon.h"
+#include "cpustat.h"
+#include "console.h"
+
+extern void _write (const char *s, int len);
+
+#define CONSOLE_LINE_SIZE 64
+#define CONSOLE_MAX_ARGS 3
+
+static char line[CONSOLE_LINE_SIZE];
+static uint8_t line_len;
+static uint8_t last_cr;
+
+static const char *const accel_names[MOUSE_ACCEL_NUM_PRESETS] = {
+	[MOUSE_ACCEL_OFF] = "off",
+	[MOUSE_ACCEL_LOW] = "low",
+	[MOUSE_ACCEL_MEDIUM] = "medium",
+	[MOUSE_ACCEL_HIGH] = "high",
+};
+
+/* Output is built a line at a time, so each line goes to the ring in one
+ * write.  A command with a lot to say can still find the ring full. */
+static char out[96];
+static uint8_t out_len;
+
+static void out_str(const char *s)
+{
+	while (*s && out_len < sizeof(out) - 2)
+		out[out_len++] = *s++;
+}
+
+static void out_uint(uint32_t v)
+{
+	char s[10];
+	int i = 0;
+	do
+	{
+		s[i++] = '0' + v % 10;
+		v /= 10;
+	}
+	while (v);
+	while (i && out_len < sizeof(out) - 2)
+		out[out_len++] = s[--i];
+}
+
+static void out_field(const char *name, uint32_t v)
+{
+	out_str(" ");
+	out_str(name);
+	out_str(" ");
+	out_uint(v);
+}
+
+static void out_line(void)
+{
+	out[out_len++] = '\r';
+	out[out_len++] = '\n';
+	_write(out, out_len);
+	out_len = 0;
+}
+
+static int on_off(const char *arg, int *on)
+{
+	if (!strcmp(arg, "on"))
+		*on = 1;
+	else if (!strcmp(arg, "off"))
+		*on = 0;
+	else
+		return -1;
+	return 0;
+}
+
+static void cmd_help(void)
+{
+	static const char help[] =
+		"stats              USART counters\r\n"
+		"lat                report latency histograms\r\n"
+		"cpu                thread wakeups and run time\r\n"
+		"stacks             stack high-water marks\r\n"
+		"clear lat|cpu      zero the histograms or CPU counters\r\n"
+		"accel [PRESET]     mouse acceleration, off low medium high\r\n"
+#ifdef MOUSE_SCROLL_EMULATION
+		"scroll [on|off]    middle button scrolling\r\n"
+#endif
+		"coalesce [on|off]  send only the newest keyboard report\r\n"
+		"poll [MS]          HID polling interval, 1-255, from the next bus reset\r\n"
+		"bell on|off        sound the keyboard bell\r\n"
+		"click on|off       keyclick\r\n"
+		"kbreset            reset the keyboards\r\n";
+	_write(help, sizeof(help) - 1);
+}
+
+static void cmd_stats(void)
+{
+	for (int i = 1; i <= INPUT_NUM_PORTS; ++i)
+	{
+		struct sun_usart_stats *stats = sun_usart_get_stats(i);
+		if (stats == NULL)
+			continue;
+		out_str("usart");
+		out_uint(i);
+		out_field("rx", stats->rx_bytes);
+		out_field("overrun", stats->overrun);
+		out_field("framing", stats->framing);
+		out_field("noise", stats->noise);
+		out_field("resyncs", stats->resyncs);
+		out_field("dropped", stats->dropped);
+		out_line();
+	}
+}
+
+/* Only the buckets with counts, by their upper bound */
+static void print_histogram(const char *name, const uint32_t *hist)
+{
+	for (int i = 0; i < HID_LATENCY_BUCKETS; ++i)
+	{
+		if (hist[i] == 0)
+			continue;
+		out_str(name);
+		if (i == HID_LATENCY_BUCKETS - 1)
+			out_str(" from ");
+		else
+			out_str(" under ");
+		out_uint(i == HID_LATENCY_BUCKETS - 1 ? 1 << (i - 1) : 1 << i);
+		out_str(" us:");
+		out_uint(hist[i]);
+		out_line();
+	}
+}
+
+static void cmd_lat(void)
+{
+	struct hid_latency *kbd = hid_get_latency(HID_INTERFACE_0);
+	struct hid_latency *mouse = hid_get_latency(HID_INTERFACE_1);
+	print_histogram("keyboard queued", kbd->queued);
+	print_histogram("keyboard acked", kbd->acked);
+	print_histogram("mouse queued", mouse->queued);
+	print_histogram("mouse acked", mouse->acked);
+}
+
+static void cmd_cpu(void)
+{
+	static const char *const names[CPUSTAT_NUM] = {
+		[CPUSTAT_MAIN] = "main",
+		[CPUSTAT_USB] = "usb",
+		[CPUSTAT_INPUT] = "input",
+	};
+	const struct cpustat *cpu = cpustat_get();
+	out_field("elapsed_ms", (uint32_t)(cpu->elapsed / 1000));
+	out_field("idle_permille", cpu->idle_permille);
+	out_line();
+	for (int i = 0; i < CPUSTAT_NUM; ++i)
+	{
+		out_str(names[i]);
+		out_field("wakeups", cpu->thread[i].wakeups);
+		out_field("run_us", cpu->thread[i].run);
+		out_field("longest_us", cpu->thread[i].longest);
+		out_line();
+	}
+}
+
+static void cmd_stacks(void)
+{
+	static const char *const names[STACK_ID_NUM] = {
+		[STACK_ID_MAIN] = "main",
+		[STACK_ID_USB] = "usb",
+		[STACK_ID_INPUT] = "input",
+	};
+	const struct stack_usage *usage = stack_get_usage();
+	for (int i = 0; i < STACK_ID_NUM; ++i)
+	{
+		out_str(names[i]);
+		out_field("used", usage[i].used);
+		out_field("of", usage[i].size);
+		out_line();
+	}
+}
+
+static int cmd_accel(int argc, char **argv)
+{
+	if (argc == 1)
+	{
+		out_str(accel_names[mouse_accel_get_preset()]);
+		out_line();
+		return 0;
+	}
+	for (uint8_t i = 0; i < MOUSE_ACCEL_NUM_PRESETS; ++i)
+		if (!strcmp(argv[1], accel_names[i]))
+			return mouse_accel_set_preset(i);
+	return -1;
+}
+
+static int cmd_poll(int argc, char **argv)
+{
+	uint32_t ms = 0;
+	if (argc == 1)
+	{
+		out_uint(usb_desc_get_hid_interval());
+		out_str(" ms");
+		out_line();
+		return 0;
+	}
+	for (const char *p = argv[1]; *p; ++p)
+	{
+		if (*p < '0' || *p > '9' || ms > 255)
+			return -1;
+		ms = ms * 10 + *p - '0';
+	}
+	if (ms < 1 || ms > 255)
+		return -1;
+	usb_desc_set_hid_interval(ms);
+	return 0;
+}
+
+static void console_command(int argc, char **argv)
+{
+	int on;
+	int ret = 0;
+
+	if (!strcmp(argv[0], "help"))
+		cmd_help();
+	else if (!strcmp(argv[0], "stats"))
+		cmd_stats();
+	else if (!strcmp(argv[0], "lat"))
+		cmd_lat();
+	else if (!strcmp(argv[0], "cpu"))
+		cmd_cpu();
+	else if (!strcmp(argv[0], "stacks"))
+		cmd_stacks();
+	else if (!strcmp(argv[0], "clear") && argc == 2 && !strcmp(argv[1], "lat"))
+		hid_reset_latency();
+	else if (!strcmp(argv[0], "clear") && argc == 2 && !strcmp(argv[1], "cpu"))
+		cpustat_reset();
+	else if (!strcmp(argv[0], "accel"))
+		ret = cmd_accel(argc, argv);
+#ifdef MOUSE_SCROLL_EMULATION
+	else if (!strcmp(argv[0], "scroll") && argc == 1)
+	{
+		out_str(mouse_scroll_get_enabled() ? "on" : "off");
+		out_line();
+	}
+	else if (!strcmp(argv[0], "scroll") && (ret = on_off(argv[1], &on)) == 0)
+		mouse_scroll_set_enabled(on);
+#endif
+	else if (!strcmp(argv[0], "coalesce") && argc == 1)
+	{
+		out_str(hid_get_keyb_coalesce() ? "on" : "off");
+		out_line();
+	}
+	else if (!strcmp(argv[0], "coalesce") && (ret = on_off(argv[1], &on)) == 0)
+		hid_set_keyb_coalesce(on);
+	else if (!strcmp(argv[0], "poll"))
+		ret = cmd_poll(argc, argv);
+	else if (!strcmp(argv[0], "bell") && argc == 2 && (ret = on_off(argv[1], &on)) == 0)
+	{
+		uint8_t command = on ? SUN_KBD_CMD_BELL_ON : SUN_KBD_CMD_BELL_OFF;
+		ret = keyboard_command(&command, 1, NULL, 0);
+	}
+	else if (!strcmp(argv[0], "click") && argc == 2 && (ret = on_off(argv[1], &on)) == 0)
+	{
+		uint8_t command = on ? SUN_KBD_CMD_CLICK_ON : SUN_KBD_CMD_CLICK_OFF;
+		ret = keyboard_command(&command, 1, NULL, 0);
+	}
+	else if (!strcmp(argv[0], "kbreset"))
+	{
+		static const uint8_t reset_command = SUN_KBD_CMD_RESET;
+		ret = keyboard_command(&reset_command, 1, NULL, 0);
+	}
+	else
+		ret = -1;
+
+	if (ret < 0)
+		_write("?\r\n", 3);
+}
+
+static void console_line(void)
+{
+	char *argv[CONSOLE_MAX_ARGS];
+	int argc = 0;
+	char *p = line;
+
+	line[line_len] = 0;
+	while (*p && argc < CONSOLE_MAX_ARGS)
+	{
+		while (*p == ' ')
+			*p++ = 0;
+		if (*p == 0)
+			break;
+		argv[argc++] = p;
+		while (*p && *p != ' ')
+			++p;
+	}
+	if (argc)
+		console_command(argc, argv);
+	_write("> ", 2);
+}
+
+/* Characters are echoed, a line runs when CR or LF comes */
+void console_input(const uint8_t *buf, int len)
+{
+	for (int i = 0; i < len; ++i)
+	{
+		char c = buf[i];
+		/* CR LF is one line end */
+		if (c == '\n' && last_cr)
+		{
+			last_cr = 0;
+			continue;
+		}
+		last_cr = (c == '\r');
+		if (c == '\r' || c == '\n')
+		{
+			_write("\r\n", 2);
+			console_line();
+			line_len = 0;
+		}
+		else if ((c == '\b' || c == 0x7f) && line_len)
+		{
+			--line_len;
+			_write("\b \b", 3);
+		}
+		else if (c >= ' ' && c < 0x7f && line_len < CONSOLE_LINE_SIZE - 1)
+		{
+			line[line_len++] = c;
+			_write(&c, 1);
+		}
+	}
+}
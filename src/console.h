@@ -0,0 +1,3 @@
+/* Command line on the CDC console, debug builds only.  Called by the USB
+ * thread with what arrived on the OUT endpoint. */
+void console_input(const uint8_t *buf, int len);
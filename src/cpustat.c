@@ -0,0 +1,112 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "timebase.h"
+#include "cpustat.h"
+
+static struct cpustat cpustat;
+static uint32_t woke_at[CPUSTAT_NUM];
+static uint32_t charged_at[CPUSTAT_NUM];
+static uint8_t running[CPUSTAT_NUM];
+
+/* Run time charged to all threads so far, wrapping.  Threads only
+ * preempt lower priority ones, so any run that ends while a thread is
+ * running was nested inside its run, and is taken off it. */
+static uint32_t charged;
+
+/* Elapsed time is kept up by the main thread, the highest priority one,
+ * which wakes at least every CPUSTAT_TICK_USEC.  tick_seq is odd while
+ * it updates. */
+static volatile uint32_t tick_seq;
+static uint64_t ticked;
+static uint32_t ticked_at;
+static uint64_t reset_at;
+
+/* The time and charged together, without a whole run of another thread
+ * falling between the two */
+static uint32_t cpustat_now(uint32_t *c)
+{
+	uint32_t now;
+	do
+	{
+		*c = __atomic_load_n(&charged, __ATOMIC_ACQUIRE);
+		now = timebase_now();
+	}
+	while (*c != __atomic_load_n(&charged, __ATOMIC_ACQUIRE));
+	return now;
+}
+
+void cpustat_sleep(int id)
+{
+	struct cpustat_thread *t = &cpustat.thread[id];
+	uint32_t now, c, run;
+	/* nothing to count before the first wakeup */
+	if (!running[id])
+		return;
+	now = cpustat_now(&c);
+	run = now - woke_at[id] - (c - charged_at[id]);
+	__atomic_fetch_add(&charged, run, __ATOMIC_RELEASE);
+	t->run += run;
+	if (run > t->longest)
+		t->longest = run;
+	running[id] = 0;
+}
+
+static void cpustat_tick(uint32_t now)
+{
+	++tick_seq;
+	__sync_synchronize();
+	ticked += now - ticked_at;
+	ticked_at = now;
+	__sync_synchronize();
+	++tick_seq;
+}
+
+void cpustat_wake(int id)
+{
+	uint32_t now = cpustat_now(&charged_at[id]);
+	++cpustat.thread[id].wakeups;
+	woke_at[id] = now;
+	running[id] = 1;
+	if (id == CPUSTAT_MAIN)
+		cpustat_tick(now);
+}
+
+/* Never preempted by the main thread part way, so tick_seq is never odd
+ * here, but it can change under the read */
+static uint64_t cpustat_elapsed(void)
+{
+	uint32_t seq;
+	uint64_t elapsed;
+	do
+	{
+		seq = tick_seq;
+		__sync_synchronize();
+		elapsed = ticked + (uint32_t)(timebase_now() - ticked_at);
+		__sync_synchronize();
+	}
+	while ((seq & 1) || seq != tick_seq);
+	return elapsed;
+}
+
+const struct cpustat *cpustat_get(void)
+{
+	uint64_t busy = 0;
+	cpustat.elapsed = cpustat_elapsed() - reset_at;
+	for (int i = 0; i < CPUSTAT_NUM; ++i)
+		busy += cpustat.thread[i].run;
+	if (cpustat.elapsed == 0 || busy >= cpustat.elapsed)
+		cpustat.idle_permille = 0;
+	else
+		cpustat.idle_permille = 1000 - (uint32_t)(busy * 1000 / cpustat.elapsed);
+	return &cpustat;
+}
+
+/* Threads other than the caller may be part way through a run, their
+ * next one counts from before the reset */
+void cpustat_reset(void)
+{
+	for (int i = 0; i < CPUSTAT_NUM; ++i)
+		memset(&cpustat.thread[i], 0, sizeof(cpustat.thread[i]));
+	reset_at = cpustat_elapsed();
+}
@@ -0,0 +1,34 @@
+/* CPU time by thread, measured at the points each thread blocks.  Time
+ * a thread spends preempted goes to the thread that preempted it.  Time
+ * in no thread, including interrupts and the scheduler, counts as idle. */
+#define CPUSTAT_MAIN	0
+#define CPUSTAT_USB	1
+#define CPUSTAT_INPUT	2
+#define CPUSTAT_NUM	3
+
+/* Times in timebase microseconds */
+struct cpustat_thread
+{
+	uint32_t wakeups;
+	uint32_t run;
+	uint32_t longest;
+};
+
+struct cpustat
+{
+	uint64_t elapsed;	/* since the last reset */
+	uint16_t idle_permille;
+	uint16_t reserved;
+	struct cpustat_thread thread[CPUSTAT_NUM];
+};
+
+/* The main thread wakes at least this often, which keeps elapsed going
+ * across wraps of the timebase while the other threads sleep */
+#define CPUSTAT_TICK_USEC (10*60*1000*1000)
+
+/* Around every blocking call of a thread, by that thread */
+void cpustat_sleep(int id);
+void cpustat_wake(int id);
+/* USB thread only */
+const struct cpustat *cpustat_get(void);
+void cpustat_reset(void);
@@ -23,6 +23,14 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <chopstx.h>
+#include <eventflag.h>
+
+#include "config.h"
+
+#include "debug.h"
+#include "dtrace.h"
+#include "timebase.h"
 
 extern void _write (const char *s, int len);
 
@@ -123,4 +131,56 @@ put_string (const char *s)
   _write (s, strlen (s));
 }
 
+static uint32_t dtrace_last;
 
+static int
+put_varint (uint8_t *p, uint32_t v)
+{
+  int n = 0;
+
+  while (v >= 0x80)
+    {
+      p[n++] = (v & 0x7f) | 0x80;
+      v >>= 7;
+    }
+  p[n++] = v;
+  return n;
+}
+
+/* A header byte, a delta of one to three bytes between mouse packets,
+   and the data as it is: a five byte mouse packet takes nine.  */
+void
+dtrace_emit (uint8_t event, uint8_t dev_no, const uint8_t *data,
+	     int count, uint32_t stamp)
+{
+  uint8_t frame[1 + 5 + DTRACE_MAX_COUNT];
+  uint32_t delta = stamp - dtrace_last;
+
+  /* Stamps from the serial ports are estimates and can run a little
+     behind the frame before.  */
+  if ((int32_t)delta < 0)
+    {
+      stamp = dtrace_last;
+      delta = 0;
+    }
+
+  do
+    {
+      int len = count > DTRACE_MAX_COUNT ? DTRACE_MAX_COUNT : count;
+      int n = 0;
+
+      frame[n++] = DTRACE_HEADER (len, event, dev_no);
+      n += put_varint (frame + n, delta);
+      if (len)
+	memcpy (frame + n, data, len);
+      n += len;
+      /* A dropped frame's delta goes into the next one.  */
+      if (!stdout_write ((const char *)frame, n))
+	return;
+      dtrace_last = stamp;
+      delta = 0;
+      data += len;
+      count -= len;
+    }
+  while (count > 0);
+}
@@ -1,9 +1,7 @@
-struct stdout {
-  chopstx_mutex_t m;
-  /**/
-  chopstx_mutex_t m_dev;
-  chopstx_cond_t cond_dev;
-  uint8_t connected;
-};
-
-extern struct stdout stdout;
+/* Output is queued in per-thread rings and sent by the USB thread, see
+   stdout_write() */
+void stdout_init (void);
+int stdout_write (const char *s, int len);
+void stdout_tx_reset (void);
+void stdout_set_connected (int connected);
+uint32_t stdout_get_dropped (void);
@@ -0,0 +1,38 @@
+/* Binary trace frames on the debug console.  Text bytes are all below
+ * 0x80, so a byte with the top bit set starts a frame.  A frame is
+ *   header, time delta, count bytes of data
+ * where the header byte is
+ *   1:1  count:3  event:2  dev_no:2
+ * and the delta, in timebase microseconds since the frame before, is an
+ * unsigned LEB128 varint.  Every event's length is in its header, so no
+ * length byte is needed.  tool/dtrace-decode.c turns frames back into
+ * text. */
+#define DTRACE_FRAME		0x80
+#define DTRACE_MAX_COUNT	7
+
+#define DTRACE_HEADER(count, event, dev_no) \
+  (DTRACE_FRAME | ((count) << 4) | ((event) << 2) | (dev_no))
+#define DTRACE_COUNT(header)	(((header) >> 4) & 7)
+#define DTRACE_EVENT(header)	(((header) >> 2) & 3)
+#define DTRACE_DEV_NO(header)	((header) & 3)
+
+/* Events; a batch longer than DTRACE_MAX_COUNT goes in several frames,
+ * the later ones with delta 0 */
+#define DTRACE_MOUSE_BYTES	0	/* bytes as read from the port */
+#define DTRACE_KEY_BYTES	1
+#define DTRACE_MOUSE_RESYNC	2	/* no data */
+
+#ifdef DEBUG
+/* The deltas chain from one frame to the next, so frames come from one
+ * thread only, the input thread. */
+void dtrace_emit (uint8_t event, uint8_t dev_no, const uint8_t *data,
+		  int count, uint32_t stamp);
+
+#define DTRACE_BYTES(event, dev_no, data, count, stamp) \
+  dtrace_emit ((event), (dev_no), (data), (count), (stamp))
+#define DTRACE_EVENT0(event, dev_no, stamp) \
+  dtrace_emit ((event), (dev_no), NULL, 0, (stamp))
+#else
+#define DTRACE_BYTES(event, dev_no, data, count, stamp)	do {} while (0)
+#define DTRACE_EVENT0(event, dev_no, stamp)		do {} while (0)
+#endif
@@ -0,0 +1,63 @@
+#include <stdint.h>
+#include <chopstx.h>
+#include <eventflag.h>
+
+#include "input_event.h"
+
+/* A power of 2.  Half a second of a fast mouse at 9600 baud */
+#define INPUT_EVENT_RING_SIZE 32
+
+/* Single producer, single consumer: only the producer moves head and only
+ * the consumer moves tail, so neither needs a lock. */
+static struct input_event ring[INPUT_EVENT_RING_SIZE];
+static volatile uint16_t ring_head;
+static volatile uint16_t ring_tail;
+
+static struct eventflag input_event_flag;
+
+void input_event_init(void)
+{
+	eventflag_init(&input_event_flag);
+}
+
+/* Returns -1, dropping the event, when the ring is full */
+int input_event_put(const struct input_event *ev)
+{
+	uint16_t head = ring_head;
+	if ((uint16_t)(head - ring_tail) >= INPUT_EVENT_RING_SIZE)
+		return -1;
+	ring[head & (INPUT_EVENT_RING_SIZE - 1)] = *ev;
+	/* the event must be in place before the consumer can see it */
+	__sync_synchronize();
+	ring_head = head + 1;
+	return 0;
+}
+
+/* Wakes the consumer, once per batch of events is enough */
+void input_event_notify(void)
+{
+	eventflag_signal(&input_event_flag, 1);
+}
+
+void input_event_prepare_poll(chopstx_poll_cond_t *poll_desc)
+{
+	eventflag_prepare_poll(&input_event_flag, poll_desc);
+}
+
+/* Clears the notification, so call it before draining the ring */
+int input_event_pending(void)
+{
+	return eventflag_get(&input_event_flag) != 0;
+}
+
+int input_event_get(struct input_event *ev)
+{
+	uint16_t tail = ring_tail;
+	if (tail == ring_head)
+		return 0;
+	__sync_synchronize();
+	*ev = ring[tail & (INPUT_EVENT_RING_SIZE - 1)];
+	__sync_synchronize();
+	ring_tail = tail + 1;
+	return 1;
+}
@@ -0,0 +1,28 @@
+/* Input events, passed from the protocol parsers on the input thread to
+ * the report builder on the USB thread */
+#define INPUT_EV_KEY_DOWN	1	/* code is the HID usage */
+#define INPUT_EV_KEY_UP		2
+#define INPUT_EV_MOUSE		3	/* code is the HID buttons, plus motion */
+#define INPUT_EV_KEY_RESET	4	/* the keyboard let go of every key */
+#define INPUT_EV_MOUSE_RESET	5	/* the mouse let go of its buttons */
+
+struct input_event
+{
+	uint8_t type;
+	uint8_t port;
+	uint8_t code;
+	int16_t x;
+	int16_t y;
+	int16_t wheel;
+	int16_t pan;
+	uint32_t stamp;		/* timebase_now() when the input arrived */
+};
+
+void input_event_init(void);
+/* producer side, one thread only */
+int input_event_put(const struct input_event *ev);
+void input_event_notify(void);
+/* consumer side, one thread only */
+void input_event_prepare_poll(chopstx_poll_cond_t *poll_desc);
+int input_event_pending(void);
+int input_event_get(struct input_event *ev);
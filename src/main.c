@@ -32,6 +32,8 @@
 #include "sys.h"
 #include "usb_lld.h"
 #include "usb-cdc.h"
+#include "stackmon.h"
+#include "cpustat.h"
 #ifdef GNU_LINUX_EMULATION
 #include <stdio.h>
 #include <stdlib.h>
@@ -151,9 +153,13 @@ static void
 emit_led (uint32_t on_time, uint32_t off_time)
 {
   set_led (!led_inverted);
+  cpustat_sleep (CPUSTAT_MAIN);
   chopstx_poll (&on_time, 1, led_event_poll);
+  cpustat_wake (CPUSTAT_MAIN);
   set_led (led_inverted);
+  cpustat_sleep (CPUSTAT_MAIN);
   chopstx_poll (&off_time, 1, led_event_poll);
+  cpustat_wake (CPUSTAT_MAIN);
 }
 
 void
@@ -200,6 +206,11 @@ extern void *usb_thread (void *arg);
 
 extern uint32_t bDeviceState;
 
+extern void timebase_init(void);
+extern void trace_init(void);
+#ifdef PROFILE
+extern void prof_init(void);
+#endif
 extern void hid_init(void);
 extern void serial_init(void);
 #ifdef DEBUG
@@ -222,6 +233,7 @@ main (int argc, const char *argv[])
 #endif
   chopstx_t usb_thd;
 
+  stack_paint (STACK_ID_MAIN);
   chopstx_conf_idle (1);
 
 #ifdef GNU_LINUX_EMULATION
@@ -305,8 +317,14 @@ main (int argc, const char *argv[])
   stdout_init ();
 #endif
 
+  timebase_init ();
+  trace_init ();
+#ifdef PROFILE
+  prof_init ();
+#endif
   hid_init();
 
+  stack_paint (STACK_ID_USB);
   usb_thd = chopstx_create (PRIO_USB, STACK_ADDR_USB, STACK_SIZE_USB,
 			     usb_thread, NULL);
 
@@ -327,9 +345,14 @@ main (int argc, const char *argv[])
     {
       eventmask_t m;
 
-      m = eventflag_wait (&led_event);
+      cpustat_sleep (CPUSTAT_MAIN);
+      m = eventflag_wait_timeout (&led_event, CPUSTAT_TICK_USEC);
+      cpustat_wake (CPUSTAT_MAIN);
       switch (m)
 	{
+	case 0:
+	  /* Only woke to keep the CPU time going.  */
+	  break;
 	case LED_ONESHOT:
 	  emit_led (100*1000, LED_TIMEOUT_STOP);
 	  break;
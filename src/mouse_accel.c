@@ -0,0 +1,88 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+#include "mouse_accel.h"
+
+#ifndef MOUSE_ACCEL_DEFAULT
+#define MOUSE_ACCEL_DEFAULT MOUSE_ACCEL_OFF
+#endif
+
+/* Gains are 8.8 fixed point (256 == 1.0), indexed by speed in counts per
+ * report.  Unity below a small threshold, then rising linearly to a cap:
+ *   low:    1 + (v-3)/16, max 2.0
+ *   medium: 1 + (v-2)/8,  max 3.0
+ *   high:   1 + (v-1)/4,  max 4.0
+ */
+#define ACCEL_SHIFT 8
+#define ACCEL_TABLE_SIZE 32
+
+/* {{{ Gain tables */
+static const uint16_t accel_tables[MOUSE_ACCEL_NUM_PRESETS-1][ACCEL_TABLE_SIZE] = {
+	/* MOUSE_ACCEL_LOW */
+	{ 256,  256,  256,  256,  272,  288,  304,  320,
+	  336,  352,  368,  384,  400,  416,  432,  448,
+	  464,  480,  496,  512,  512,  512,  512,  512,
+	  512,  512,  512,  512,  512,  512,  512,  512 },
+	/* MOUSE_ACCEL_MEDIUM */
+	{ 256,  256,  256,  288,  320,  352,  384,  416,
+	  448,  480,  512,  544,  576,  608,  640,  672,
+	  704,  736,  768,  768,  768,  768,  768,  768,
+	  768,  768,  768,  768,  768,  768,  768,  768 },
+	/* MOUSE_ACCEL_HIGH */
+	{ 256,  256,  320,  384,  448,  512,  576,  640,
+	  704,  768,  832,  896,  960, 1024, 1024, 1024,
+	 1024, 1024, 1024, 1024, 1024, 1024, 1024, 1024,
+	 1024, 1024, 1024, 1024, 1024, 1024, 1024, 1024 },
+};
+/* }}} End gain tables */
+
+static volatile uint8_t accel_preset = MOUSE_ACCEL_DEFAULT;
+
+int mouse_accel_set_preset(uint8_t preset)
+{
+	if (preset >= MOUSE_ACCEL_NUM_PRESETS)
+		return -1;
+	accel_preset = preset;
+	return 0;
+}
+
+uint8_t mouse_accel_get_preset(void)
+{
+	return accel_preset;
+}
+
+static int16_t accel_apply(int16_t d, uint16_t gain, int32_t *rem)
+{
+	int32_t v = *rem + (int32_t)d * gain;
+	/* arithmetic shift floors, so the remainder carried is never negative */
+	int32_t out = v >> ACCEL_SHIFT;
+	*rem = v - (out << ACCEL_SHIFT);
+	return out;
+}
+
+/* The preset is shared, the remainders are the mouse's own, a is
+ * zeroed to begin with */
+void mouse_accel(struct mouse_accel *a, int16_t *x, int16_t *y)
+{
+	uint8_t preset = accel_preset;
+	uint16_t ax, ay, speed;
+
+	if (preset == MOUSE_ACCEL_OFF)
+		return;
+
+	/* max + min/2 approximates the vector length without a sqrt */
+	ax = *x < 0 ? -*x : *x;
+	ay = *y < 0 ? -*y : *y;
+	if (ax > ay)
+		speed = ax + (ay >> 1);
+	else
+		speed = ay + (ax >> 1);
+	if (speed >= ACCEL_TABLE_SIZE)
+		speed = ACCEL_TABLE_SIZE - 1;
+
+	*x = accel_apply(*x, accel_tables[preset-1][speed], &a->rem_x);
+	*y = accel_apply(*y, accel_tables[preset-1][speed], &a->rem_y);
+}
+
+/* vim: set foldmethod=marker :*/
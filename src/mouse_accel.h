@@ -0,0 +1,17 @@
+/* Pointer acceleration presets, MOUSE_ACCEL_OFF passes motion through */
+#define MOUSE_ACCEL_OFF 0
+#define MOUSE_ACCEL_LOW 1
+#define MOUSE_ACCEL_MEDIUM 2
+#define MOUSE_ACCEL_HIGH 3
+#define MOUSE_ACCEL_NUM_PRESETS 4
+
+int mouse_accel_set_preset(uint8_t preset);
+uint8_t mouse_accel_get_preset(void);
+/* Sub-count remainders of one mouse, always in [0, 256) */
+struct mouse_accel
+{
+	int32_t rem_x;
+	int32_t rem_y;
+};
+
+void mouse_accel(struct mouse_accel *a, int16_t *x, int16_t *y);
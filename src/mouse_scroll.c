@@ -0,0 +1,116 @@
+#include <stdint.h>
+
+#include "config.h"
+#include "usb_hid.h"
+#include "mouse_scroll.h"
+
+#ifdef MOUSE_SCROLL_EMULATION
+
+/* counts of travel with the middle button held before it turns into
+ * scrolling instead of a middle click */
+#define SCROLL_THRESHOLD 4
+/* counts of travel per wheel/pan detent, as a power of 2 */
+#define SCROLL_SHIFT 3
+/* counts of travel per high resolution step */
+#define SCROLL_HIRES_SHIFT (SCROLL_SHIFT - HID_MOUSE_WHEEL_RES_SHIFT)
+
+#if SCROLL_HIRES_SHIFT < 0
+#error "SCROLL_SHIFT must not be finer than the wheel resolution"
+#endif
+
+enum scroll_state
+{
+	SCROLL_IDLE,
+	SCROLL_ARMED,
+	SCROLL_ACTIVE,
+};
+
+/* Whether the middle button scrolls is one setting for every mouse */
+static uint8_t scroll_enabled = 1;
+
+void mouse_scroll_set_enabled(int enabled)
+{
+	scroll_enabled = enabled != 0;
+}
+
+int mouse_scroll_get_enabled(void)
+{
+	return scroll_enabled;
+}
+
+/* Takes the HID buttons from mouse s and returns the ones to report.
+ * The middle button is held back while it may start scrolling.  If it is
+ * released without having scrolled, *click is set and the caller should
+ * report a middle press before the returned state. */
+uint8_t mouse_scroll_buttons(struct mouse_scroll *s, uint8_t buttons, int *click)
+{
+	uint8_t middle = buttons & HID_MOUSE_BUTTON_MIDDLE;
+
+	*click = 0;
+	if (s->state == SCROLL_IDLE)
+	{
+		if (!middle || !scroll_enabled)
+			return buttons;
+		s->state = SCROLL_ARMED;
+		s->travel = 0;
+		s->rem_wheel = 0;
+		s->rem_pan = 0;
+	}
+	else if (!middle)
+	{
+		*click = s->state == SCROLL_ARMED;
+		s->state = SCROLL_IDLE;
+	}
+	return buttons & ~HID_MOUSE_BUTTON_MIDDLE;
+}
+
+/* Converts travel into high resolution steps, the HID layer turns those
+ * into whole detents for hosts that haven't enabled the multiplier */
+static int16_t scroll_steps(int16_t *rem)
+{
+	int16_t d;
+	/* round towards zero so small wiggles don't scroll either way */
+	if (*rem >= 0)
+		d = *rem >> SCROLL_HIRES_SHIFT;
+	else
+		d = -((-*rem) >> SCROLL_HIRES_SHIFT);
+	*rem -= d << SCROLL_HIRES_SHIFT;
+	return d;
+}
+
+/* Returns non-zero if the motion was consumed by scrolling, in which case
+ * x and y are cleared and wheel and pan hold the steps to report. */
+int mouse_scroll_move(struct mouse_scroll *s, int16_t *x, int16_t *y, int16_t *wheel, int16_t *pan)
+{
+	*wheel = 0;
+	*pan = 0;
+	if (s->state == SCROLL_IDLE)
+		return 0;
+
+	if (s->state == SCROLL_ARMED)
+	{
+		s->travel += (*x < 0 ? -*x : *x) + (*y < 0 ? -*y : *y);
+		if (s->travel < SCROLL_THRESHOLD)
+		{
+			*x = 0;
+			*y = 0;
+			return 1;
+		}
+		s->state = SCROLL_ACTIVE;
+	}
+
+	/* HID Y grows downwards, the wheel grows away from the user */
+#ifdef MOUSE_WHEEL
+	s->rem_wheel -= *y;
+	*wheel = scroll_steps(&s->rem_wheel);
+#endif
+#ifdef MOUSE_PAN
+	s->rem_pan += *x;
+	*pan = scroll_steps(&s->rem_pan);
+#endif
+	*x = 0;
+	*y = 0;
+	return 1;
+}
+
+#endif
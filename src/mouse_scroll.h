@@ -0,0 +1,19 @@
+/* Middle button scroll emulation, only built when the report has a
+ * wheel or pan field to feed */
+#if defined(MOUSE_WHEEL) || defined(MOUSE_PAN)
+#define MOUSE_SCROLL_EMULATION 1
+
+void mouse_scroll_set_enabled(int enabled);
+int mouse_scroll_get_enabled(void);
+/* Chord state of one mouse, zeroed is idle */
+struct mouse_scroll
+{
+	uint8_t state;
+	uint16_t travel;
+	int16_t rem_wheel;
+	int16_t rem_pan;
+};
+
+uint8_t mouse_scroll_buttons(struct mouse_scroll *s, uint8_t buttons, int *click);
+int mouse_scroll_move(struct mouse_scroll *s, int16_t *x, int16_t *y, int16_t *wheel, int16_t *pan);
+#endif
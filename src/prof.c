@@ -0,0 +1,57 @@
+#include <stdint.h>
+#include <string.h>
+#ifdef GNU_LINUX_EMULATION
+#include <time.h>
+#endif
+
+#include "config.h"
+
+#include "stm32f103_local.h"
+#include "prof.h"
+
+static struct prof_zone prof_zones[PROF_NUM_ZONES];
+
+void prof_init(void)
+{
+#ifndef GNU_LINUX_EMULATION
+	DEMCR |= DEMCR_TRCENA;
+	DWT_CYCCNT = 0;
+	DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+#endif
+	prof_reset();
+}
+
+/* Wraps, so only differences mean anything */
+uint32_t prof_now(void)
+{
+#ifdef GNU_LINUX_EMULATION
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#else
+	return DWT_CYCCNT;
+#endif
+}
+
+void prof_record(int zone, uint32_t elapsed)
+{
+	struct prof_zone *z = &prof_zones[zone];
+	++z->count;
+	z->total += elapsed;
+	if (elapsed < z->min)
+		z->min = elapsed;
+	if (elapsed > z->max)
+		z->max = elapsed;
+}
+
+struct prof_zone *prof_get_zones(void)
+{
+	return prof_zones;
+}
+
+void prof_reset(void)
+{
+	memset(prof_zones, 0, sizeof(prof_zones));
+	for (int i = 0; i < PROF_NUM_ZONES; ++i)
+		prof_zones[i].min = UINT32_MAX;
+}
@@ -0,0 +1,33 @@
+/* Profiling zones, built in with --enable-profile.  A zone is timed
+ * between PROF_BEGIN and PROF_END in one block, in CPU cycles, or in
+ * nanoseconds under GNU_LINUX_EMULATION.  Each zone must only be entered
+ * from one thread. */
+#define PROF_USB_EVENT		0	/* usb_event_handle() */
+#define PROF_HID_INPUT		1	/* hid_input_process() */
+#define PROF_KEY_PRESSED	2	/* hid_key_pressed() */
+#define PROF_SUN2HID		3	/* sun2hid_keycode() */
+#define PROF_USART_READ		4	/* sun_usart_read(), servicing the port */
+#define PROF_NUM_ZONES		5
+
+struct prof_zone
+{
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+};
+
+#ifdef PROFILE
+#define PROF_BEGIN(zone)	uint32_t prof_start_##zone = prof_now()
+#define PROF_END(zone)		prof_record(zone, prof_now() - prof_start_##zone)
+#else
+#define PROF_BEGIN(zone)	do {} while (0)
+#define PROF_END(zone)		do {} while (0)
+#endif
+
+void prof_init(void);
+uint32_t prof_now(void);
+void prof_record(int zone, uint32_t elapsed);
+/* Returns PROF_NUM_ZONES zones, reset sets them back to nothing seen */
+struct prof_zone *prof_get_zones(void);
+void prof_reset(void);
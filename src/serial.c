@@ -2,131 +2,474 @@
 #include <stdint.h>
 #include <string.h>
 #include <chopstx.h>
+#include <eventflag.h>
 
 #include "config.h"
 #include "board.h"
-#include <contrib/usart.h>
 
 #include "stm32f103_local.h"
+#include "sun_usart.h"
+#include "sun_usart_stats.h"
+#include "timebase.h"
 
 #include "sun_xlate.h"
+#include "mouse_accel.h"
+#include "mouse_scroll.h"
 #include "usb_hid.h"
+#include "input_event.h"
+#include "trace.h"
+#include "prof.h"
+#include "stackmon.h"
+#include "cpustat.h"
+#include "dtrace.h"
+#include "serial.h"
 
 extern void _write (const char *s, int len);
-#ifdef DEBUG
-extern void put_byte_with_no_nl(uint8_t);
-extern void put_int(uint32_t);
-extern void put_short(uint16_t);
-extern void put_binary (const char *, int);
-#endif
 
-#define STACK_PROCESS_2
 #define STACK_PROCESS_3
-#define STACK_PROCESS_4
 #include "stack-def.h"
-#define STACK_ADDR_USART ((uintptr_t)process2_base)
-#define STACK_SIZE_USART (sizeof process2_base)
-#define STACK_ADDR_KEYBOARD ((uintptr_t)process3_base)
-#define STACK_SIZE_KEYBOARD (sizeof process3_base)
-#define STACK_ADDR_MOUSE ((uintptr_t)process4_base)
-#define STACK_SIZE_MOUSE (sizeof process4_base)
+#define STACK_ADDR_INPUT ((uintptr_t)process3_base)
+#define STACK_SIZE_INPUT (sizeof process3_base)
+
+#define PRIO_INPUT 4
+
+/* Rates tried when looking for the mouse, the first is the usual one */
+static const uint32_t mouse_bauds[] = {1200, 2400, 4800, 9600};
+#define MOUSE_NUM_BAUDS (sizeof(mouse_bauds)/sizeof(mouse_bauds[0]))
+
+/* Packet lengths: 5 byte Mouse Systems (two delta pairs), 3 byte Sun */
+static const uint8_t mouse_packet_lens[] = {5, 3};
+#define MOUSE_NUM_PACKET_LENS (sizeof(mouse_packet_lens)/sizeof(mouse_packet_lens[0]))
+
+/* a multiple of every packet length, so each sees whole packets */
+#define MOUSE_DETECT_WINDOW 15
+/* bad bytes that disqualify a rate while detecting */
+#define MOUSE_DETECT_MAX_ERRORS 2
+/* bad bytes or malformed packets, with no good packet in between,
+ * before the mouse is assumed to have changed and detection restarts */
+#define MOUSE_RESYNC_LIMIT 8
+
+/* bytes taken from a USART at once */
+#define INPUT_RX_BATCH 16
 
-#define PRIO_USART 5
-#define PRIO_KEYBOARD 4
-#define PRIO_MOUSE 3
+#define IS_MOUSE_HEADER(b) (((b) & 0xF8) == 0x80)
 
-static int my_callback (uint8_t dev_no, uint16_t notify_bits)
+/* Returns the packet length whose headers line up all through the
+ * window, or 0 if none does */
+static uint8_t mouse_detect_framing(const uint8_t *window)
 {
-	(void)dev_no;
-	(void)notify_bits;
+	for (unsigned int l = 0; l < MOUSE_NUM_PACKET_LENS; ++l)
+	{
+		uint8_t len = mouse_packet_lens[l];
+		for (uint8_t offset = 0; offset < len; ++offset)
+		{
+			uint8_t i;
+			for (i = offset; i < MOUSE_DETECT_WINDOW; i += len)
+				if (!IS_MOUSE_HEADER(window[i]))
+					break;
+			if (i >= MOUSE_DETECT_WINDOW)
+				return len;
+		}
+	}
 	return 0;
 }
 
-static void *
-mouse_main(void *arg)
-{
-	int8_t buf[4];
-	struct {
-	       uint8_t idx:3;
-	       uint8_t buttons_changed:1;
-	} state = {0, 0};
-	uint8_t read_byte;
-	(void)arg;
-	chopstx_usec_wait(250*1000);
-	while (usart_read(2, (char *)&read_byte, 1))
+/* Mouse protocol state, fed a byte at a time */
+struct mouse_port
+{
+	uint8_t dev_no;
+	uint8_t detecting;
+	uint8_t baud_idx;
+	uint8_t len;		/* packet length found by detection */
+	uint8_t idx;		/* bytes so far, len while waiting for a header */
+	uint8_t header;
+	uint8_t bad;
+	uint8_t lost;
+	uint8_t errors;
+	int8_t delta[4];
+	uint8_t window[MOUSE_DETECT_WINDOW];
+	struct mouse_accel accel;
+#ifdef MOUSE_SCROLL_EMULATION
+	struct mouse_scroll scroll;
+#endif
+};
+
+/* Hands an event to the report builder.  An event the ring has no room
+ * for counts as dropped. */
+static void input_put(const struct input_event *ev, struct sun_usart_stats *stats)
+{
+	trace_record(TRACE_EVENT, (ev->type << 12) | (ev->port << 8) | ev->code, ev->stamp);
+	if (input_event_put(ev) < 0)
+		++stats->dropped;
+}
+
+/* Detection cycles through the candidate rates until the mouse sends a
+ * window of bytes with no line errors and consistent framing.  The mouse
+ * only talks when it is moved, so this can take a while. */
+static void mouse_detect_start(struct mouse_port *m)
+{
+	sun_usart_config(m->dev_no, mouse_bauds[m->baud_idx]);
+	m->detecting = 1;
+	m->idx = 0;
+	m->errors = 0;
+	/* whatever mouse turns up starts with no chord or remainders */
+	memset(&m->accel, 0, sizeof(m->accel));
+#ifdef MOUSE_SCROLL_EMULATION
+	memset(&m->scroll, 0, sizeof(m->scroll));
+#endif
+}
+
+static void mouse_detect_next(struct mouse_port *m)
+{
+	m->baud_idx = (m->baud_idx + 1) % MOUSE_NUM_BAUDS;
+	mouse_detect_start(m);
+}
+
+static void mouse_detect_byte(struct mouse_port *m, const struct sun_usart_rx *rx)
+{
+	/* the window has to be bytes in a row */
+	if ((rx->flags & SUN_USART_LOST))
+		m->idx = 0;
+	m->window[m->idx++] = rx->data;
+	if ((rx->flags & SUN_USART_ERROR) && ++m->errors >= MOUSE_DETECT_MAX_ERRORS)
 	{
-#ifdef DEBUG
-		put_byte_with_no_nl(read_byte);
+		mouse_detect_next(m);
+	}
+	else if (m->idx == MOUSE_DETECT_WINDOW)
+	{
+		m->len = mouse_detect_framing(m->window);
+		if (m->len == 0)
+		{
+			mouse_detect_next(m);
+			return;
+		}
+		m->detecting = 0;
+		/* wait for the next header */
+		m->idx = m->len;
+		m->bad = 0;
+		m->lost = 1;
+	}
+}
+
+/* Only whole packets get here, so a damaged one never moves the cursor.
+ * stamp is when the last byte arrived. */
+static void mouse_packet(struct mouse_port *m, uint8_t ndelta,
+			 uint32_t stamp, struct sun_usart_stats *stats)
+{
+	uint8_t port = m->dev_no - 1;
+	uint8_t header = m->header;
+	const int8_t *delta = m->delta;
+	uint8_t buttons = sun2hid_mousebuttons(header);
+	int16_t x = 0, y = 0, wheel = 0, pan = 0;
+#ifdef MOUSE_SCROLL_EMULATION
+	int click;
+	buttons = mouse_scroll_buttons(&m->scroll, buttons, &click);
+	if (click)
+	{
+		struct input_event ev = {
+			.type = INPUT_EV_MOUSE,
+			.port = port,
+			.code = buttons | HID_MOUSE_BUTTON_MIDDLE,
+			.stamp = stamp,
+		};
+		input_put(&ev, stats);
+	}
 #endif
-		if ((read_byte & 0xF8) == 0x80)
+	for (uint8_t i = 0; i + 1 < ndelta; i += 2)
+	{
+		int16_t dx = delta[i];
+		int16_t dy = -delta[i+1];
+		int16_t dwheel = 0;
+		int16_t dpan = 0;
+#ifdef MOUSE_SCROLL_EMULATION
+		if (!mouse_scroll_move(&m->scroll, &dx, &dy, &dwheel, &dpan))
+			mouse_accel(&m->accel, &dx, &dy);
+#else
+		mouse_accel(&m->accel, &dx, &dy);
+#endif
+		x += dx;
+		y += dy;
+		wheel += dwheel;
+		pan += dpan;
+	}
+	struct input_event ev = {
+		.type = INPUT_EV_MOUSE,
+		.port = port,
+		.code = buttons,
+		.x = x,
+		.y = y,
+		.wheel = wheel,
+		.pan = pan,
+		.stamp = stamp,
+	};
+	input_put(&ev, stats);
+}
+
+/* Packets are framed by the header byte and by idle gaps on the line.
+ * Once a header is seen the next len-1 bytes are deltas whatever they
+ * look like; a gap or a line error before that drops the packet.
+ * stats->dropped counts damaged or stray packets, stats->resyncs
+ * restarts of detection. */
+static void mouse_input(struct mouse_port *m, const struct sun_usart_rx *rx,
+			struct sun_usart_stats *stats)
+{
+	if (m->detecting)
+	{
+		mouse_detect_byte(m, rx);
+		return;
+	}
+	if ((rx->flags & SUN_USART_LOST))
+	{
+		/* where this byte falls in a packet is anyone's guess */
+		if (m->idx < m->len)
+			++stats->dropped;
+		m->idx = m->len;
+		m->lost = 1;
+	}
+	if ((rx->flags & SUN_USART_IDLE))
+	{
+		if (m->idx < m->len)
 		{
-			state.buttons_changed = hid_mouse_set_buttons(sun2hid_mousebuttons(read_byte)) > 0;
-			state.idx = 0;
+			/* truncated */
+			++stats->dropped;
+			++m->bad;
+			m->idx = m->len;
 		}
-		else if (state.idx < 4)
+		m->lost = 0;
+	}
+	if ((rx->flags & SUN_USART_ERROR))
+	{
+		if (m->idx < m->len)
+			++stats->dropped;
+		++m->bad;
+		m->idx = m->len;
+		/* the rest of this packet is noise until a gap or header */
+		m->lost = 1;
+	}
+	else if (m->idx < m->len)
+	{
+		m->delta[m->idx++ - 1] = rx->data;
+		if (m->idx == m->len)
 		{
-			buf[state.idx++] = read_byte;
-			if (state.idx == 2 && (state.buttons_changed || buf[0] != 0 || buf[1] != 0))
-				hid_mouse_move(buf[0], -buf[1]);
-			else if (state.idx == 4 && (buf[2] != 0 || buf[3] != 0))
-				hid_mouse_move(buf[2], -buf[3]);
+			mouse_packet(m, m->len - 1, rx->stamp, stats);
+			m->bad = 0;
 		}
 	}
-	return NULL;
+	else if (IS_MOUSE_HEADER(rx->data))
+	{
+		m->header = rx->data;
+		m->idx = 1;
+		m->lost = 0;
+	}
+	else if (!m->lost)
+	{
+		/* stray byte where a header should be */
+		++stats->dropped;
+		++m->bad;
+	}
+	if (m->bad >= MOUSE_RESYNC_LIMIT)
+	{
+		/* buttons held now may never see their release */
+		struct input_event ev = {
+			.type = INPUT_EV_MOUSE_RESET,
+			.port = m->dev_no - 1,
+			.stamp = rx->stamp,
+		};
+		++stats->resyncs;
+		DTRACE_EVENT0(DTRACE_MOUSE_RESYNC, m->dev_no, rx->stamp);
+		input_put(&ev, stats);
+		mouse_detect_start(m);
+	}
 }
 
-static void *
-keyboard_main(void *arg)
+/* Keyboard protocol state */
+struct keyboard_port
 {
-	uint8_t read_byte;
-	(void)arg;
-	chopstx_usec_wait(250*1000);
-	/* chances are we missed POST, so send a reset command */
-	read_byte = 0x01;
-	usart_write(3, (char *)&read_byte, 1);
-	while (usart_read(3, (char *)&read_byte, 1))
+	uint8_t dev_no;
+	uint8_t response;	/* response whose second byte comes next */
+};
+
+static void keyboard_input(struct keyboard_port *k, const struct sun_usart_rx *rx,
+			   struct sun_usart_stats *stats)
+{
+	uint8_t read_byte = rx->data;
+	struct input_event ev = {
+		.port = k->dev_no - 1,
+		.stamp = rx->stamp,
+	};
+	/* Lost bytes may have been releases, better to let go of every
+	 * key than to leave one stuck */
+	if ((rx->flags & SUN_USART_LOST))
 	{
-		uint8_t hidcode;
-#ifdef DEBUG
-		//put_byte_with_no_nl(read_byte);
-#endif
-		switch (read_byte)
+		ev.type = INPUT_EV_KEY_RESET;
+		input_put(&ev, stats);
+		k->response = 0;
+	}
+	/* Line errors drop the byte, as the chopstx driver used to */
+	if ((rx->flags & SUN_USART_ERROR))
+	{
+		++stats->dropped;
+		return;
+	}
+	if (k->response)
+	{
+		switch (k->response)
 		{
-		case 0xff: /* reset response */
-			usart_read(3, (char *)&read_byte, 1);
+		case 0xff:
 			/* better be 4 */
 			//assert(read_byte == 0x04);
 			break;
-		case 0xfe: /* Layout request reponse */
-			usart_read(3, (char *)&read_byte, 1);
+		case 0xfe:
 			/* layout dip switches */
 			break;
-		case 0x7e: /* Failed self-test */
-			usart_read(3, (char *)&read_byte, 1);
+		case 0x7e:
 			/* better be 1 */
 			//assert(read_byte == 0x01);
 			break;
-		case 0x7f: /* Idle */
-			hid_key_releaseAll();
-			break;
-		default:
-			hidcode = sun2hid_keycode(read_byte);
-			if (hidcode != 0)
-			{
-				if (read_byte & 0x80)
-					hid_key_released(hidcode);
-				else
-					hid_key_pressed(hidcode);
-			}
 		}
+		k->response = 0;
+		return;
+	}
+	switch (read_byte)
+	{
+	case 0xff: /* reset response */
+		/* a keyboard that reset has let go of every key */
+		ev.type = INPUT_EV_KEY_RESET;
+		input_put(&ev, stats);
+		k->response = read_byte;
+		break;
+	case 0xfe: /* Layout request reponse */
+	case 0x7e: /* Failed self-test */
+		k->response = read_byte;
+		break;
+	case 0x7f: /* Idle */
+		ev.type = INPUT_EV_KEY_RESET;
+		input_put(&ev, stats);
+		break;
+	default:
+	{
+		PROF_BEGIN(PROF_SUN2HID);
+		ev.code = sun2hid_keycode(read_byte);
+		PROF_END(PROF_SUN2HID);
+		if (ev.code != 0)
+		{
+			ev.type = (read_byte & 0x80) ? INPUT_EV_KEY_UP : INPUT_EV_KEY_DOWN;
+			input_put(&ev, stats);
+		}
+	}
+	}
+}
+
+static struct input_port
+{
+	uint8_t protocol;
+	struct sun_usart_stats *stats;
+	union {
+		struct mouse_port mouse;
+		struct keyboard_port keyboard;
+	};
+} input_ports[INPUT_NUM_PORTS] = {
+	{ .protocol = USART1_INPUT },
+	{ .protocol = USART2_INPUT },
+	{ .protocol = USART3_INPUT },
+};
+
+/* Runs the port's protocol over everything it has pending */
+static void input_drain(struct input_port *port, uint8_t dev_no)
+{
+	struct sun_usart_rx rx[INPUT_RX_BATCH];
+	int n;
+	/* a full batch may have left more behind */
+	do
+	{
+		n = sun_usart_read(dev_no, rx, INPUT_RX_BATCH);
+#ifdef DEBUG
+		if (n > 0)
+		{
+			/* the whole batch in one frame, stamped by its first byte */
+			uint8_t bytes[INPUT_RX_BATCH];
+			for (int i = 0; i < n; ++i)
+				bytes[i] = rx[i].data;
+			DTRACE_BYTES(port->protocol == INPUT_KEYBOARD ? DTRACE_KEY_BYTES : DTRACE_MOUSE_BYTES,
+				     dev_no, bytes, n, rx[0].stamp);
+		}
+#endif
+		for (int i = 0; i < n; ++i)
+		{
+			trace_record(TRACE_RX, (rx[i].flags << 12) | ((dev_no - 1) << 8) | rx[i].data, rx[i].stamp);
+			if (port->protocol == INPUT_KEYBOARD)
+				keyboard_input(&port->keyboard, &rx[i], port->stats);
+			else
+				mouse_input(&port->mouse, &rx[i], port->stats);
+		}
+	}
+	while (n == INPUT_RX_BATCH);
+}
+
+/* One thread waits on every port and runs their protocols.  Keyboards go
+ * first, a keystroke is the more noticeable delay. */
+static void *
+input_main(void *arg)
+{
+	static const uint8_t reset_command = SUN_KBD_CMD_RESET;
+	struct chx_poll_head *poll[2 * INPUT_NUM_PORTS];
+	int npoll = 0;
+	(void)arg;
+	chopstx_usec_wait(250*1000);
+	for (int i = 0; i < INPUT_NUM_PORTS; ++i)
+	{
+		struct input_port *port = &input_ports[i];
+		uint8_t dev_no = i + 1;
+		if (port->protocol == INPUT_NONE)
+			continue;
+		port->stats = sun_usart_get_stats(dev_no);
+		if (port->protocol == INPUT_KEYBOARD)
+		{
+			port->keyboard.dev_no = dev_no;
+			/* chances are we missed POST, so send a reset command */
+			sun_usart_write(dev_no, &reset_command, 1, NULL, 0);
+		}
+		else
+		{
+			port->mouse.dev_no = dev_no;
+			mouse_detect_start(&port->mouse);
+		}
+		npoll += sun_usart_poll_heads(dev_no, &poll[npoll]);
+	}
+
+	while (1)
+	{
+		cpustat_sleep(CPUSTAT_INPUT);
+		chopstx_poll(NULL, npoll, poll);
+		cpustat_wake(CPUSTAT_INPUT);
+		for (int i = 0; i < INPUT_NUM_PORTS; ++i)
+			if (input_ports[i].protocol == INPUT_KEYBOARD)
+				input_drain(&input_ports[i], i + 1);
+		for (int i = 0; i < INPUT_NUM_PORTS; ++i)
+			if (input_ports[i].protocol == INPUT_MOUSE)
+				input_drain(&input_ports[i], i + 1);
+		input_event_notify();
 	}
 	return NULL;
 }
 
+/* Sends to every keyboard port without waiting.  With ev, mask is
+ * signalled once per port as the command goes out.  Returns -1 if a
+ * port's queue was full. */
+int keyboard_command(const uint8_t *cmd, int len, struct eventflag *ev, eventmask_t mask)
+{
+	int ret = 0;
+	for (int i = 0; i < INPUT_NUM_PORTS; ++i)
+		if (input_ports[i].protocol == INPUT_KEYBOARD
+		    && sun_usart_write(i + 1, cmd, len, ev, mask) < 0)
+			ret = -1;
+	return ret;
+}
+
 void keyboard_set_leds(uint8_t hid_leds)
 {
-	uint8_t set_leds_command[2] = {0x0E, hid2sun_leds(hid_leds)};
-	usart_write(3, (char *)set_leds_command, 2);
+	uint8_t set_leds_command[2] = {SUN_KBD_CMD_LED, hid2sun_leds(hid_leds)};
+	keyboard_command(set_leds_command, 2, NULL, 0);
 }
 
 void serial_init(void)
@@ -142,10 +485,17 @@ void serial_init(void)
 	GPIOB->CRL = 0x88888888;
 	GPIOB->CRH = 0x88888A88;
 
-	usart_init(PRIO_USART, STACK_ADDR_USART, STACK_SIZE_USART, my_callback);
-	usart_config(2, B1200 | CS8 | STOP2B);
-	usart_config(3, B1200 | CS8 | STOP2B);
-	chopstx_create(PRIO_KEYBOARD, STACK_ADDR_KEYBOARD, STACK_SIZE_KEYBOARD, keyboard_main, NULL);
-	chopstx_create(PRIO_MOUSE, STACK_ADDR_MOUSE, STACK_SIZE_MOUSE, mouse_main, NULL);
+#if USART1_INPUT != INPUT_NONE
+	/* PA10 input pull-up, PA9 alt function push-pull 2MHz */
+	GPIOA->ODR |= (1 << 10);
+	GPIOA->CRH = (GPIOA->CRH & ~0x00000FF0) | 0x000008A0;
+#endif
+
+	sun_usart_init();
+	for (int i = 0; i < INPUT_NUM_PORTS; ++i)
+		if (input_ports[i].protocol != INPUT_NONE)
+			sun_usart_config(i + 1, 1200);
+	stack_paint(STACK_ID_INPUT);
+	chopstx_create(PRIO_INPUT, STACK_ADDR_INPUT, STACK_SIZE_INPUT, input_main, NULL);
 }
 
@@ -1,2 +1,21 @@
+/* Protocols an input port can speak, chosen by configure */
+#define INPUT_NONE 0
+#define INPUT_MOUSE 1
+#define INPUT_KEYBOARD 2
+
+/* USART1 to USART3 */
+#define INPUT_NUM_PORTS 3
+
+/* Sun keyboard commands */
+#define SUN_KBD_CMD_RESET	0x01
+#define SUN_KBD_CMD_BELL_ON	0x02
+#define SUN_KBD_CMD_BELL_OFF	0x03
+#define SUN_KBD_CMD_CLICK_ON	0x0A
+#define SUN_KBD_CMD_CLICK_OFF	0x0B
+#define SUN_KBD_CMD_LED		0x0E
+
+struct eventflag;
+
 void serial_init(void);
+int keyboard_command(const uint8_t *cmd, int len, struct eventflag *ev, eventmask_t mask);
 void keyboard_set_leds(uint8_t hid_leds);
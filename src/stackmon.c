@@ -0,0 +1,77 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "stack-def.h"
+#include "stackmon.h"
+
+#define STACK_PAINT 0xa5
+
+/* Defined in stack-def.h by the module owning each thread */
+#ifndef GNU_LINUX_EMULATION
+extern char process0_base[];
+#endif
+extern char process1_base[];
+extern char process3_base[];
+
+static const struct
+{
+	char *base;
+	uint16_t size;
+} stacks[STACK_ID_NUM] = {
+#ifndef GNU_LINUX_EMULATION
+	[STACK_ID_MAIN] = { process0_base, SIZE_0 },
+#endif
+	[STACK_ID_USB] = { process1_base, SIZE_1 },
+	[STACK_ID_INPUT] = { process3_base, SIZE_3 },
+};
+
+static struct stack_usage stack_usage[STACK_ID_NUM];
+
+extern void fatal(uint8_t code);
+
+void stack_paint(int id)
+{
+	size_t len = stacks[id].size;
+	if (stacks[id].base == NULL)
+		return;
+#ifndef GNU_LINUX_EMULATION
+	if (id == STACK_ID_MAIN)
+	{
+		uintptr_t sp;
+		__asm__ volatile ("mov %0, sp" : "=r" (sp));
+		/* leave room for this function's own frame */
+		len = sp - 32 - (uintptr_t)stacks[id].base;
+	}
+#endif
+	memset(stacks[id].base, STACK_PAINT, len);
+}
+
+/* Stacks grow down, so the paint left at the base is what was never used */
+static uint16_t stack_used(int id)
+{
+	uint16_t unused = 0;
+	if (stacks[id].base == NULL)
+		return 0;
+	while (unused < stacks[id].size && (uint8_t)stacks[id].base[unused] == STACK_PAINT)
+		++unused;
+	return stacks[id].size - unused;
+}
+
+const struct stack_usage *stack_get_usage(void)
+{
+	for (int i = 0; i < STACK_ID_NUM; ++i)
+	{
+		stack_usage[i].used = stack_used(i);
+		stack_usage[i].size = stacks[i].size;
+	}
+	return stack_usage;
+}
+
+void stack_check(void)
+{
+	for (int i = 0; i < STACK_ID_NUM; ++i)
+		if (stacks[i].base != NULL && stack_used(i) + STACK_MARGIN > stacks[i].size)
+			fatal(FATAL_STACK);
+}
@@ -0,0 +1,25 @@
+/* Stack high-water marks.  Stacks are painted before their thread runs
+ * and the marks show how much of each has ever been touched. */
+#define STACK_ID_MAIN	0
+#define STACK_ID_USB	1
+#define STACK_ID_INPUT	2
+#define STACK_ID_NUM	3
+
+/* The debug build stops with fatal(FATAL_STACK) when a stack is used to
+ * within this many bytes of its end */
+#ifndef STACK_MARGIN
+#define STACK_MARGIN 64
+#endif
+#define FATAL_STACK 1
+
+struct stack_usage
+{
+	uint16_t used;
+	uint16_t size;
+};
+
+/* main's stack is in use, only the part below the caller is painted */
+void stack_paint(int id);
+/* Fills in and returns STACK_ID_NUM entries */
+const struct stack_usage *stack_get_usage(void);
+void stack_check(void);
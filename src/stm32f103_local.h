@@ -22,6 +22,21 @@ Define_DMA1_ChannelN(7);
 #define DMA1_CHANNEL6_IRQ 16
 #define DMA1_CHANNEL7_IRQ 17
 
+#define DMA_CCR_EN		(1 <<  0)
+#define DMA_CCR_TCIE		(1 <<  1)
+#define DMA_CCR_HTIE		(1 <<  2)
+#define DMA_CCR_TEIE		(1 <<  3)
+#define DMA_CCR_DIR		(1 <<  4)
+#define DMA_CCR_CIRC		(1 <<  5)
+#define DMA_CCR_PINC		(1 <<  6)
+#define DMA_CCR_MINC		(1 <<  7)
+#define DMA_CCR_PL_HIGH		(2 << 12)
+
+/* GIF, TCIF, HTIF and TEIF of channel n */
+#define DMA_ISR_CHANNEL(n)	(0xf << (4*((n)-1)))
+#define DMA_ISR_TCIF(n)		(0x2 << (4*((n)-1)))
+#define DMA_ISR_HTIF(n)		(0x4 << (4*((n)-1)))
+
 #define TIM1_BASE (APB2PERIPH_BASE + 0x2C00)
 static struct TIM *const TIM1 = (struct TIM *)TIM1_BASE;
 #define TIM1_BRK_IRQ 24
@@ -78,7 +93,11 @@ static struct USART *const USART3 = (struct USART *)USART3_BASE;
 #define USART_CR3_RTSE		(1 <<  8)
 #define USART_CR3_SCEN		(1 <<  5)
 #define USART_CR3_NACK		(1 <<  4)
+#define USART_CR3_DMAT		(1 <<  7)
+#define USART_CR3_DMAR		(1 <<  6)
+#define USART_CR3_EIE		(1 <<  0)
 
+#define USART1_IRQ 37
 #define USART2_IRQ 38
 #define USART3_IRQ 39
 
@@ -90,3 +109,16 @@ static struct USART *const USART3 = (struct USART *)USART3_BASE;
 
 #define RCC_APB1ENR_USART2EN	(1 << 17)
 #define RCC_APB1ENR_USART3EN	(1 << 18)
+
+/* Cortex-M3 debug unit, for the cycle counter */
+#define DEMCR		(*(volatile uint32_t *)0xE000EDFC)
+#define DEMCR_TRCENA	(1 << 24)
+#define DWT_CTRL	(*(volatile uint32_t *)0xE0001000)
+#define DWT_CTRL_CYCCNTENA	(1 << 0)
+#define DWT_CYCCNT	(*(volatile uint32_t *)0xE0001004)
+
+/* USB control register, for remote wakeup; the rest is the lld's */
+#define USB_CNTR	(*(volatile uint32_t *)(APB1PERIPH_BASE + 0x5C40))
+#define USB_CNTR_RESUME	(1 << 4)
+#define USB_CNTR_FSUSP	(1 << 3)
+#define USB_CNTR_LPMODE	(1 << 2)
@@ -0,0 +1,358 @@
+#include <stdint.h>
+#include <string.h>
+#include <chopstx.h>
+#include <eventflag.h>
+
+#include "config.h"
+#include "board.h"
+
+#include "stm32f103_local.h"
+#include "sun_usart.h"
+#include "sun_usart_stats.h"
+#include "serial.h"
+#include "prof.h"
+#include "timebase.h"
+
+/* USART1 is on APB2 at the core clock, USART2 and USART3 hang off
+ * APB1, which runs at half that */
+#define PCLK2 (MHZ * 1000000)
+#define PCLK1 (MHZ * 1000000 / 2)
+
+#define SUN_USART_NUM 3
+
+/* 1 start, 8 data, 2 stop bits */
+#define BITS_PER_CHAR 11
+
+/* DMA fills these circularly, a power of 2.  At 9600 baud 64 bytes is
+ * over 70ms of slack for the reader. */
+#define RX_BUF_SIZE 64
+
+/* Keyboard commands are one or two bytes, so this holds a good burst */
+#define TX_BUF_SIZE 32
+#define TX_DONE_NUM 4
+
+/* A command that wants to know when its last byte is on the wire */
+struct sun_usart_tx_done
+{
+	uint16_t end;
+	struct eventflag *ev;
+	eventmask_t mask;
+};
+
+static struct sun_usart
+{
+	struct USART *USARTx;
+	uint32_t pclk;
+	struct DMA_Channel *dma;
+	uint8_t dma_ch;
+	uint8_t irq;
+	uint8_t dma_irq;
+	uint8_t rx_tail;
+	uint8_t rx_seen;
+	uint32_t rx_seen_stamp;
+	uint32_t char_usec;
+	chopstx_intr_t intr;
+	chopstx_intr_t dma_intr;
+	struct chx_poll_head *poll[2];
+	chopstx_mutex_t tx_mut;
+	/* free running counts: bytes queued and bytes given to DR */
+	uint16_t tx_head;
+	uint16_t tx_loaded;
+	uint8_t tx_done_head;
+	uint8_t tx_done_count;
+	struct sun_usart_tx_done tx_done[TX_DONE_NUM];
+	uint8_t tx_buf[TX_BUF_SIZE];
+	uint8_t rx_buf[RX_BUF_SIZE];
+	uint8_t rx_flags[RX_BUF_SIZE];
+	uint32_t rx_stamp[RX_BUF_SIZE];
+	struct sun_usart_stats stats;
+} sun_usart[SUN_USART_NUM];
+
+static struct sun_usart *get_usart(uint8_t dev_no)
+{
+	if (dev_no < 1 || dev_no > SUN_USART_NUM)
+		return NULL;
+	/* left alone when nothing is attached */
+	if (sun_usart[dev_no - 1].USARTx == NULL)
+		return NULL;
+	return &sun_usart[dev_no - 1];
+}
+
+struct sun_usart_stats *sun_usart_get_stats(uint8_t dev_no)
+{
+	struct sun_usart *p = get_usart(dev_no);
+	if (p == NULL)
+		return NULL;
+	return &p->stats;
+}
+
+static void sun_usart_setup(struct sun_usart *p, struct USART *USARTx, uint32_t pclk,
+			    uint8_t irq, struct DMA_Channel *dma, uint8_t dma_ch, uint8_t dma_irq)
+{
+	p->USARTx = USARTx;
+	p->pclk = pclk;
+	p->irq = irq;
+	p->dma = dma;
+	p->dma_ch = dma_ch;
+	p->dma_irq = dma_irq;
+	chopstx_mutex_init(&p->tx_mut);
+	chopstx_claim_irq(&p->intr, irq);
+	chopstx_claim_irq(&p->dma_intr, dma_irq);
+	p->poll[0] = (struct chx_poll_head *)&p->intr;
+	p->poll[1] = (struct chx_poll_head *)&p->dma_intr;
+}
+
+void sun_usart_init(void)
+{
+	RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+#if USART1_INPUT != INPUT_NONE
+	RCC->APB2ENR |= RCC_APB2ENR_USART1EN;
+	RCC->APB2RSTR = RCC_APB2RSTR_USART1RST;
+	RCC->APB2RSTR = 0;
+#endif
+	RCC->APB1ENR |= RCC_APB1ENR_USART2EN | RCC_APB1ENR_USART3EN;
+	RCC->APB1RSTR = RCC_APB1RSTR_USART2RST | RCC_APB1RSTR_USART3RST;
+	RCC->APB1RSTR = 0;
+
+	/* fixed request mapping: USART1_RX on DMA channel 5, USART2_RX on 6,
+	 * USART3_RX on 3 */
+#if USART1_INPUT != INPUT_NONE
+	sun_usart_setup(&sun_usart[0], USART1, PCLK2, USART1_IRQ, DMA1_Channel5, 5, DMA1_CHANNEL5_IRQ);
+#endif
+	sun_usart_setup(&sun_usart[1], USART2, PCLK1, USART2_IRQ, DMA1_Channel6, 6, DMA1_CHANNEL6_IRQ);
+	sun_usart_setup(&sun_usart[2], USART3, PCLK1, USART3_IRQ, DMA1_Channel3, 3, DMA1_CHANNEL3_IRQ);
+}
+
+int sun_usart_config(uint8_t dev_no, uint32_t baud)
+{
+	struct sun_usart *p = get_usart(dev_no);
+	if (p == NULL || baud == 0)
+		return -1;
+
+	p->USARTx->CR1 = 0;
+	p->dma->CCR = 0;
+	DMA1->IFCR = DMA_ISR_CHANNEL(p->dma_ch);
+
+	p->USARTx->BRR = (p->pclk + baud / 2) / baud;
+	p->USARTx->CR2 = (2 << 12);	/* 2 stop bits */
+	p->USARTx->CR3 = USART_CR3_DMAR | USART_CR3_EIE;
+	p->char_usec = (BITS_PER_CHAR * 1000000 + baud - 1) / baud;
+
+	/* anything left over is from the old rate */
+	memset(p->rx_flags, 0, sizeof(p->rx_flags));
+	p->rx_tail = 0;
+	p->rx_seen = 0;
+	p->rx_seen_stamp = timebase_now();
+	p->dma->CPAR = (uint32_t)(uintptr_t)&p->USARTx->DR;
+	p->dma->CMAR = (uint32_t)(uintptr_t)p->rx_buf;
+	p->dma->CNDTR = RX_BUF_SIZE;
+	p->dma->CCR = DMA_CCR_PL_HIGH | DMA_CCR_MINC | DMA_CCR_CIRC
+		| DMA_CCR_HTIE | DMA_CCR_TCIE | DMA_CCR_EN;
+
+	chopstx_mutex_lock(&p->tx_mut);
+	p->USARTx->CR1 = USART_CR1_UE | USART_CR1_IDLEIE | USART_CR1_TE | USART_CR1_RE
+		| (p->tx_head != p->tx_loaded ? USART_CR1_TXEIE : 0);
+	chopstx_mutex_unlock(&p->tx_mut);
+	return 0;
+}
+
+/* Where DMA will put the next byte */
+static uint8_t sun_usart_rx_head(struct sun_usart *p)
+{
+	return (RX_BUF_SIZE - p->dma->CNDTR) & (RX_BUF_SIZE - 1);
+}
+
+/* DMA doesn't say when each byte came in, only that it is there by now.
+ * Assume new bytes arrived back to back, ending a character time ago,
+ * but not before the last time we looked. */
+static void sun_usart_stamp(struct sun_usart *p, uint8_t head)
+{
+	uint32_t now = timebase_now();
+	uint32_t d = (head - p->rx_seen) & (RX_BUF_SIZE - 1);
+	p->stats.rx_bytes += d;
+	for (uint8_t i = p->rx_seen; i != head; i = (i + 1) & (RX_BUF_SIZE - 1), --d)
+	{
+		uint32_t stamp = now - d * p->char_usec;
+		if ((int32_t)(stamp - p->rx_seen_stamp) < 0)
+			stamp = p->rx_seen_stamp;
+		p->rx_stamp[i] = stamp;
+	}
+	p->rx_seen = head;
+	p->rx_seen_stamp = now;
+}
+
+/* The DMA position alone can't tell a whole lap of the buffer from
+ * none.  The half transfer and transfer complete flags can: each says
+ * the DMA reached that half's end since they were last cleared.  A flag
+ * for an end not between rx_seen and head means a lap.  So does a path
+ * past both ends, which may have been one, and new bytes running into
+ * the unread ones.  dma is the flags read just before head. */
+static int sun_usart_lapped(struct sun_usart *p, uint32_t dma, uint8_t head)
+{
+	uint8_t d = (head - p->rx_seen) & (RX_BUF_SIZE - 1);
+	uint8_t unread = (p->rx_seen - p->rx_tail) & (RX_BUF_SIZE - 1);
+	int ends = 0;
+	if ((dma & DMA_ISR_HTIF(p->dma_ch)))
+	{
+		/* also set when head was right at the end last time */
+		if (((RX_BUF_SIZE / 2 - p->rx_seen - 1) & (RX_BUF_SIZE - 1)) < d)
+			++ends;
+		else if (p->rx_seen != RX_BUF_SIZE / 2)
+			return 1;
+	}
+	if ((dma & DMA_ISR_TCIF(p->dma_ch)))
+	{
+		if (((RX_BUF_SIZE - p->rx_seen - 1) & (RX_BUF_SIZE - 1)) < d)
+			++ends;
+		else if (p->rx_seen != 0)
+			return 1;
+	}
+	return ends == 2 || unread + d >= RX_BUF_SIZE;
+}
+
+/* Feeds DR one byte per TXE and signals the commands that are out.  When
+ * TXE is set the last byte loaded is still shifting out, once TC is set
+ * everything is. */
+static void sun_usart_service_tx(struct sun_usart *p)
+{
+	uint32_t sr;
+	uint16_t done;
+	chopstx_mutex_lock(&p->tx_mut);
+	sr = p->USARTx->SR;
+	if ((sr & USART_SR_TXE))
+	{
+		done = (sr & USART_SR_TC) ? p->tx_loaded : p->tx_loaded - 1;
+		while (p->tx_done_count
+		       && (int16_t)(done - p->tx_done[p->tx_done_head].end) >= 0)
+		{
+			struct sun_usart_tx_done *d = &p->tx_done[p->tx_done_head];
+			eventflag_signal(d->ev, d->mask);
+			p->tx_done_head = (p->tx_done_head + 1) % TX_DONE_NUM;
+			--p->tx_done_count;
+		}
+		if (p->tx_loaded != p->tx_head)
+		{
+			p->USARTx->DR = p->tx_buf[p->tx_loaded++ & (TX_BUF_SIZE - 1)];
+			if (p->tx_loaded == p->tx_head)
+				/* wait for TC only if someone wants to know */
+				p->USARTx->CR1 = (p->USARTx->CR1 & ~USART_CR1_TXEIE)
+					| (p->tx_done_count ? USART_CR1_TCIE : 0);
+		}
+		else
+		{
+			p->USARTx->CR1 &= ~(USART_CR1_TXEIE | USART_CR1_TCIE);
+		}
+	}
+	chopstx_mutex_unlock(&p->tx_mut);
+}
+
+/* Turns pending USART events into flags on the buffer.  An error belongs
+ * to the byte just received, an idle line to the one that comes next.
+ * Reading DR is what clears IDLE and the error flags, so the DMA
+ * position is taken before SR: an IDLE seen then ended no later than
+ * head, and bytes after it are still to come.  After a lap nothing
+ * buffered is passed on, the next byte is flagged SUN_USART_LOST. */
+static void sun_usart_service(struct sun_usart *p)
+{
+	uint32_t dma, sr;
+	uint8_t head;
+	dma = DMA1->ISR & DMA_ISR_CHANNEL(p->dma_ch);
+	DMA1->IFCR = DMA_ISR_CHANNEL(p->dma_ch);
+	head = sun_usart_rx_head(p);
+	sr = p->USARTx->SR;
+	if ((sr & (USART_SR_IDLE | USART_SR_ORE | USART_SR_NE | USART_SR_FE)))
+		(void)p->USARTx->DR;
+	if ((sr & USART_SR_FE))
+		++p->stats.framing;
+	if ((sr & USART_SR_NE))
+		++p->stats.noise;
+	if (sun_usart_lapped(p, dma, head))
+	{
+		++p->stats.overrun;
+		sun_usart_stamp(p, head);
+		memset(p->rx_flags, 0, sizeof(p->rx_flags));
+		p->rx_tail = head;
+		p->rx_flags[head] = SUN_USART_LOST;
+	}
+	else
+	{
+		if ((sr & USART_SR_ORE))
+			++p->stats.overrun;
+		sun_usart_stamp(p, head);
+		if ((sr & (USART_SR_ORE | USART_SR_NE | USART_SR_FE)))
+			p->rx_flags[(head - 1) & (RX_BUF_SIZE - 1)] |= SUN_USART_ERROR;
+	}
+	if ((sr & USART_SR_IDLE))
+		p->rx_flags[head] |= SUN_USART_IDLE;
+	sun_usart_service_tx(p);
+	chopstx_intr_done(&p->intr);
+	chopstx_intr_done(&p->dma_intr);
+}
+
+int sun_usart_poll_heads(uint8_t dev_no, struct chx_poll_head **pd)
+{
+	struct sun_usart *p = get_usart(dev_no);
+	if (p == NULL)
+		return 0;
+	pd[0] = p->poll[0];
+	pd[1] = p->poll[1];
+	return 2;
+}
+
+/* The poll heads fire on half transfer, transfer complete or an idle
+ * line, so the reader normally sees a whole packet, or a whole keystroke,
+ * at once. */
+int sun_usart_read(uint8_t dev_no, struct sun_usart_rx *buf, int buflen)
+{
+	struct sun_usart *p = get_usart(dev_no);
+	int n = 0;
+	if (p == NULL)
+		return -1;
+
+	PROF_BEGIN(PROF_USART_READ);
+	sun_usart_service(p);
+	/* only bytes that have been stamped */
+	while (p->rx_tail != p->rx_seen && n < buflen)
+	{
+		buf[n].data = p->rx_buf[p->rx_tail];
+		buf[n].flags = p->rx_flags[p->rx_tail];
+		buf[n].stamp = p->rx_stamp[p->rx_tail];
+		p->rx_flags[p->rx_tail] = 0;
+		p->rx_tail = (p->rx_tail + 1) & (RX_BUF_SIZE - 1);
+		++n;
+	}
+	PROF_END(PROF_USART_READ);
+	return n;
+}
+
+/* Queues the bytes and returns, the reader's sun_usart_read() sends
+ * them as TXE comes up, so this only works on a port being read.  If ev
+ * is given mask is signalled on it once the last byte has been sent.
+ * Returns -1, queueing nothing, if there is no room. */
+int sun_usart_write(uint8_t dev_no, const uint8_t *buf, int len,
+		    struct eventflag *ev, eventmask_t mask)
+{
+	struct sun_usart *p = get_usart(dev_no);
+	if (p == NULL)
+		return -1;
+
+	chopstx_mutex_lock(&p->tx_mut);
+	if (len > TX_BUF_SIZE - (uint16_t)(p->tx_head - p->tx_loaded)
+	    || (ev != NULL && p->tx_done_count == TX_DONE_NUM))
+	{
+		chopstx_mutex_unlock(&p->tx_mut);
+		return -1;
+	}
+	for (int i = 0; i < len; ++i)
+		p->tx_buf[p->tx_head++ & (TX_BUF_SIZE - 1)] = buf[i];
+	if (ev != NULL)
+	{
+		struct sun_usart_tx_done *d = &p->tx_done[(p->tx_done_head + p->tx_done_count++) % TX_DONE_NUM];
+		d->end = p->tx_head;
+		d->ev = ev;
+		d->mask = mask;
+	}
+	p->USARTx->CR1 |= USART_CR1_TXEIE;
+	chopstx_mutex_unlock(&p->tx_mut);
+	return len;
+}
@@ -0,0 +1,21 @@
+/* Per byte receive flags */
+#define SUN_USART_IDLE	0x01	/* the line was idle before this byte */
+#define SUN_USART_ERROR	0x02	/* framing/noise error, or bytes lost before it */
+#define SUN_USART_LOST	0x04	/* the buffer overran, bytes before this one are gone */
+
+struct sun_usart_rx
+{
+	uint8_t data;
+	uint8_t flags;
+	uint32_t stamp;		/* timebase_now() when the byte arrived */
+};
+
+void sun_usart_init(void);
+int sun_usart_config(uint8_t dev_no, uint32_t baud);
+/* Fills pd[] with the heads to chopstx_poll() on for input, returns how many */
+int sun_usart_poll_heads(uint8_t dev_no, struct chx_poll_head **pd);
+/* Doesn't block, returns up to buflen of the bytes pending */
+int sun_usart_read(uint8_t dev_no, struct sun_usart_rx *buf, int buflen);
+/* Doesn't block, see sun_usart.c for when the bytes actually go */
+int sun_usart_write(uint8_t dev_no, const uint8_t *buf, int len,
+		    struct eventflag *ev, eventmask_t mask);
@@ -0,0 +1,21 @@
+/* Receive counters of a port, kept apart from the rest of sun_usart.h
+ * so the USB side can read them without the eventflag types.
+ *
+ * overrun, framing and noise count services of the port that found the
+ * error, not bytes: the flags only say that some byte since the last
+ * service had it, so several bad bytes in one batch count once.  Read
+ * them as lower bounds.  overrun also counts the DMA lapping the
+ * buffer, and rx_bytes then misses the lap.  resyncs and dropped are
+ * kept by the protocol code above. */
+struct sun_usart_stats
+{
+	uint32_t rx_bytes;
+	uint32_t overrun;
+	uint32_t framing;
+	uint32_t noise;
+	uint32_t resyncs;
+	uint32_t dropped;
+};
+
+/* NULL for a port that isn't set up */
+struct sun_usart_stats *sun_usart_get_stats(uint8_t dev_no);
@@ -0,0 +1,50 @@
+#include <stdint.h>
+#include <chopstx.h>
+
+#include "config.h"
+#include "board.h"
+
+#include "stm32f103_local.h"
+#include "timebase.h"
+
+#define TIM_CR1_CEN	(1 << 0)
+#define TIM_CR2_MMS_UPDATE	(2 << 4)
+#define TIM_SMCR_TS_ITR0	(0 << 4)
+#define TIM_SMCR_SMS_EXTCLK	(7 << 0)
+#define TIM_EGR_UG	(1 << 0)
+
+/* TIM1 counts microseconds and overflows into TIM2, which TIM2 sees on
+ * ITR0, so the pair makes one 32 bit counter without any interrupts. */
+void timebase_init(void)
+{
+	RCC->APB2ENR |= RCC_APB2ENR_TIM1EN;
+	RCC->APB2RSTR = RCC_APB2RSTR_TIM1RST;
+	RCC->APB2RSTR = 0;
+	RCC->APB1ENR |= RCC_APB1ENR_TIM2EN;
+	RCC->APB1RSTR = RCC_APB1RSTR_TIM2RST;
+	RCC->APB1RSTR = 0;
+
+	TIM2->SMCR = TIM_SMCR_TS_ITR0 | TIM_SMCR_SMS_EXTCLK;
+	TIM2->ARR = 0xffff;
+	TIM2->CR1 = TIM_CR1_CEN;
+
+	/* APB2 is not divided, so TIM1 runs at the core clock */
+	TIM1->PSC = MHZ - 1;
+	TIM1->ARR = 0xffff;
+	TIM1->CR2 = TIM_CR2_MMS_UPDATE;
+	TIM1->EGR = TIM_EGR_UG;		/* load PSC */
+	TIM2->CNT = 0;
+	TIM1->CR1 = TIM_CR1_CEN;
+}
+
+uint32_t timebase_now(void)
+{
+	uint32_t hi, lo;
+	do
+	{
+		hi = TIM2->CNT;
+		lo = TIM1->CNT;
+	}
+	while (hi != TIM2->CNT);
+	return (hi << 16) | lo;
+}
@@ -0,0 +1,4 @@
+/* Free running microsecond clock, wraps about every 71 minutes.  Compare
+ * times by subtraction. */
+void timebase_init(void);
+uint32_t timebase_now(void);
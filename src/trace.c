@@ -0,0 +1,97 @@
+#include <stdint.h>
+#include <string.h>
+#include <chopstx.h>
+
+#include "trace.h"
+
+/* A power of 2, 2KB of RAM */
+#define TRACE_SIZE 512
+
+#define TRACE_DELTA_MAX	0x0fff
+#define TRACE_TIME_MASK	0x0fffffff
+
+static struct
+{
+	chopstx_mutex_t mut;
+	uint32_t seq;		/* records written so far */
+	uint32_t last;		/* time of the newest record */
+	uint8_t since_sync;
+	uint32_t ring[TRACE_SIZE];
+} trace;
+
+void trace_init(void)
+{
+	chopstx_mutex_init(&trace.mut);
+	/* start with a TIME record */
+	trace.since_sync = TRACE_SYNC_INTERVAL;
+}
+
+static void trace_put(uint32_t rec)
+{
+	trace.ring[trace.seq++ & (TRACE_SIZE - 1)] = rec;
+	++trace.since_sync;
+}
+
+/* Called with the lock held */
+static void trace_put_timed(uint8_t type, uint16_t payload, uint32_t stamp)
+{
+	uint32_t delta = stamp - trace.last;
+	/* stamps from the serial ports are estimates and can run a little
+	 * behind the record before */
+	if ((int32_t)delta < 0)
+	{
+		stamp = trace.last;
+		delta = 0;
+	}
+	if (delta > TRACE_DELTA_MAX || trace.since_sync >= TRACE_SYNC_INTERVAL)
+	{
+		trace_put((TRACE_TIME << 28) | (stamp & TRACE_TIME_MASK));
+		trace.since_sync = 0;
+		delta = 0;
+	}
+	trace.last = stamp;
+	trace_put(((uint32_t)type << 28) | (delta << 16) | payload);
+}
+
+void trace_record(uint8_t type, uint16_t payload, uint32_t stamp)
+{
+	chopstx_mutex_lock(&trace.mut);
+	trace_put_timed(type, payload, stamp);
+	chopstx_mutex_unlock(&trace.mut);
+}
+
+void trace_record_data(uint8_t type, uint16_t payload, const void *data, int len, uint32_t stamp)
+{
+	const uint8_t *p = data;
+	chopstx_mutex_lock(&trace.mut);
+	trace_put_timed(type, payload, stamp);
+	for (int i = 0; i < len; i += 2)
+	{
+		uint16_t d = p[i];
+		if (i + 1 < len)
+			d |= p[i+1] << 8;
+		trace_put((TRACE_DATA << 28) | d);
+	}
+	chopstx_mutex_unlock(&trace.mut);
+}
+
+/* Recording doesn't stop while the host reads, so it reads a packet's
+ * worth at a time and follows on from the sequence number it got. */
+int trace_read(uint32_t seq, void *buf, int len)
+{
+	struct trace_read_header *hdr = buf;
+	uint32_t *out = (uint32_t *)(hdr + 1);
+	int n = (len - (int)sizeof(*hdr)) / 4;
+	int i;
+
+	if (n < 0)
+		return -1;
+	chopstx_mutex_lock(&trace.mut);
+	if (trace.seq - seq > TRACE_SIZE)
+		seq = trace.seq > TRACE_SIZE ? trace.seq - TRACE_SIZE : 0;
+	hdr->seq = seq;
+	for (i = 0; i < n && seq != trace.seq; ++i)
+		out[i] = trace.ring[seq++ & (TRACE_SIZE - 1)];
+	chopstx_mutex_unlock(&trace.mut);
+	return sizeof(*hdr) + i * 4;
+}
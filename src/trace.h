@@ -0,0 +1,29 @@
+/* Flight recorder: a ring of what the adapter saw and sent, cheap enough
+ * to always be on.  Each record is a 32 bit word,
+ *   type:4  delta:12  payload:16
+ * delta is microseconds since the record before.  Longer gaps, and every
+ * TRACE_SYNC_INTERVAL records, get a TRACE_TIME record holding the low
+ * 28 bits of timebase_now() in place of delta and payload. */
+#define TRACE_TIME	0
+#define TRACE_RX	1	/* flags << 12 | port << 8 | byte */
+#define TRACE_EVENT	2	/* type << 12 | port << 8 | code, see input_event.h */
+#define TRACE_REPORT	3	/* endpoint << 8 | length, DATA records follow */
+#define TRACE_DATA	4	/* two more bytes of the record before */
+#define TRACE_USB	5	/* event id << 8 | txrx << 4 | endpoint */
+
+#define TRACE_SYNC_INTERVAL 32
+
+/* The reply to a trace read: the sequence number of the first record,
+ * then the records */
+struct trace_read_header
+{
+	uint32_t seq;
+};
+
+void trace_init(void);
+void trace_record(uint8_t type, uint16_t payload, uint32_t stamp);
+/* len bytes of data follow in TRACE_DATA records, all in one go */
+void trace_record_data(uint8_t type, uint16_t payload, const void *data, int len, uint32_t stamp);
+/* Copies records from seq on, or the oldest kept if seq is gone, into
+ * buf.  Returns the bytes used. */
+int trace_read(uint32_t seq, void *buf, int len);
@@ -6,5 +6,5 @@
 #define USB_CDC_REQ_SET_CONTROL_LINE_STATE      0x22
 #define USB_CDC_REQ_SEND_BREAK                  0x23
 
-#define VIRTUAL_COM_PORT_DATA_SIZE              16
+#define VIRTUAL_COM_PORT_DATA_SIZE              64
 #define VIRTUAL_COM_PORT_INT_SIZE               8
@@ -32,13 +32,48 @@
 #ifdef DEBUG
 #include "usb-cdc.h"
 #include "debug.h"
-struct stdout stdout;
+
+/* Each writing thread gets a ring of its own, so writers never wait
+   for one another or for the USB thread; see stdout_write.  */
+#define STDOUT_PRODUCERS 3	/* main, input and USB threads */
+#define STDOUT_RING_SIZE 512	/* a power of 2, 8 packets */
+
+struct stdout_ring {
+  chopstx_t owner;		/* 0 until a thread claims it */
+  volatile uint16_t head;	/* moved by the owner */
+  volatile uint16_t tail;	/* moved by the USB thread */
+  uint8_t buf[STDOUT_RING_SIZE];
+};
+
+static struct {
+  struct stdout_ring ring[STDOUT_PRODUCERS];
+  struct eventflag ev;		/* wakes the USB thread */
+  uint8_t cur;			/* the ring being sent from */
+  uint16_t turn_end;		/* its head when its turn began */
+  uint16_t tx_len;		/* in flight, 0 when nothing is */
+  uint8_t tx_busy;
+  uint8_t last_full;		/* the last packet needs a ZLP after it */
+  uint8_t connected;
+  uint32_t dropped;		/* bytes that found no room */
+} stdout;
 #endif
 
 #include "usb_lld.h"
 #include "usb_conf.h"
 
 #include "usb_hid.h"
+#include "input_event.h"
+#include "timebase.h"
+#include "trace.h"
+#include "prof.h"
+#include "stackmon.h"
+#include "cpustat.h"
+#ifdef DEBUG
+#include "console.h"
+#endif
+#ifndef GNU_LINUX_EMULATION
+#include "stm32f103_local.h"
+#endif
 
 /* shit from gnuk.h */
 #define LED_FINISH_COMMAND	128
@@ -47,7 +82,9 @@ void led_blink(int spec);
 
 
 
-#if defined(DEBUG) && defined(GNU_LINUX_EMULATION)
+#ifdef DEBUG
+/* Not on the stack: the whole console command runs under usb_rx_ready
+   on the USB thread's 0x200 bytes.  */
 static uint8_t endp5_buf[VIRTUAL_COM_PORT_DATA_SIZE];
 #endif
 
@@ -57,17 +94,22 @@ usb_rx_ready (uint8_t ep_num, uint16_t len)
 #ifdef DEBUG
   if (ep_num == ENDP5)
     {
-      chopstx_mutex_lock (&stdout.m_dev);
 #ifdef GNU_LINUX_EMULATION
+      console_input (endp5_buf, len);
       usb_lld_rx_enable_buf (ep_num, endp5_buf, VIRTUAL_COM_PORT_DATA_SIZE);
 #else
+      usb_lld_rxcpy (endp5_buf, ep_num, 0, len);
       usb_lld_rx_enable (ep_num);
+      console_input (endp5_buf, len);
 #endif
-      chopstx_mutex_unlock (&stdout.m_dev);
     }
 #endif
 }
 
+#ifdef DEBUG
+static void stdout_tx_done (void);
+#endif
+
 static void
 usb_tx_done (uint8_t ep_num, uint16_t len)
 {
@@ -77,11 +119,7 @@ usb_tx_done (uint8_t ep_num, uint16_t len)
     }
 #ifdef DEBUG
   else if (ep_num == ENDP3)
-    {
-      chopstx_mutex_lock (&stdout.m_dev);
-      chopstx_cond_signal (&stdout.cond_dev);
-      chopstx_mutex_unlock (&stdout.m_dev);
-    }
+    stdout_tx_done ();
 #endif
 }
 
@@ -100,6 +138,74 @@ extern int usb_get_descriptor (struct usb_dev *dev);
 
 static chopstx_intr_t interrupt;
 
+/* Feature selector of SET_FEATURE and CLEAR_FEATURE to the device */
+#define DEVICE_REMOTE_WAKEUP 1
+
+/* Remote wakeup waits out the 5ms of idle bus the spec wants after
+   suspend, then drives resume for 10ms, it wants 1 to 15.  The host
+   carries it on and the lld reports the wakeup when it ends.  Both are
+   timed off the poll timeout, so the thread keeps serving meanwhile.  */
+#define WAKEUP_IDLE_USEC   (5*1000)
+#define WAKEUP_RESUME_USEC (10*1000)
+
+enum {
+  WAKEUP_NONE,
+  WAKEUP_WAIT,			/* Input came, waiting for the idle time */
+  WAKEUP_DRIVE,			/* Driving resume on the bus */
+};
+
+static uint8_t wakeup_state;
+static uint32_t wakeup_at;	/* Suspend, then start of resume */
+
+static void
+usb_remote_wakeup (void)
+{
+  if (wakeup_state == WAKEUP_NONE)
+    wakeup_state = WAKEUP_WAIT;
+}
+
+static void
+usb_wakeup_cancel (void)
+{
+#ifndef GNU_LINUX_EMULATION
+  if (wakeup_state == WAKEUP_DRIVE)
+    USB_CNTR &= ~USB_CNTR_RESUME;
+#endif
+  wakeup_state = WAKEUP_NONE;
+}
+
+/* Returns the microseconds until it wants to run again, 0 when idle.  */
+static uint32_t
+usb_wakeup_poll (void)
+{
+  uint32_t elapsed;
+
+  if (wakeup_state == WAKEUP_NONE)
+    return 0;
+
+  elapsed = timebase_now () - wakeup_at;
+  if (wakeup_state == WAKEUP_WAIT)
+    {
+      if (elapsed < WAKEUP_IDLE_USEC)
+	return WAKEUP_IDLE_USEC - elapsed;
+#ifndef GNU_LINUX_EMULATION
+      USB_CNTR &= ~(USB_CNTR_LPMODE | USB_CNTR_FSUSP);
+      USB_CNTR |= USB_CNTR_RESUME;
+#endif
+      wakeup_at = timebase_now ();
+      wakeup_state = WAKEUP_DRIVE;
+      return WAKEUP_RESUME_USEC;
+    }
+
+  if (elapsed < WAKEUP_RESUME_USEC)
+    return WAKEUP_RESUME_USEC - elapsed;
+  usb_wakeup_cancel ();
+  /* The host didn't take it up, so stop holding input for it.  */
+  if ((bDeviceState & USB_DEVICE_STATE_SUSPEND))
+    hid_suspend (0);
+  return 0;
+}
+
 /*
  * Return 0 for normal USB event
  *       -1 for USB reset
@@ -114,6 +220,8 @@ usb_event_handle (struct usb_dev *dev)
   e = usb_lld_event_handler (dev);
   chopstx_intr_done(&interrupt);
   ep_num = USB_EVENT_ENDP (e);
+  trace_record (TRACE_USB, (USB_EVENT_ID (e) << 8)
+		| (USB_EVENT_TXRX (e) << 4) | ep_num, timebase_now ());
 
   /* Transfer to endpoint (not control endpoint) */
   if (ep_num != 0)
@@ -129,6 +237,8 @@ usb_event_handle (struct usb_dev *dev)
   switch (USB_EVENT_ID (e))
     {
     case USB_EVENT_DEVICE_RESET:
+      usb_wakeup_cancel ();
+      hid_reset ();
       usb_device_reset (dev);
       return -1;
 
@@ -179,8 +289,26 @@ usb_event_handle (struct usb_dev *dev)
       break;
 
     case USB_EVENT_SET_FEATURE_DEVICE:
-    case USB_EVENT_SET_FEATURE_ENDPOINT:
+      if (dev->dev_req.value != DEVICE_REMOTE_WAKEUP)
+	usb_lld_ctrl_error (dev);
+      else
+	{
+	  dev->feature |= USB_REMOTE_WAKEUP;
+	  usb_lld_ctrl_ack (dev);
+	}
+      break;
+
     case USB_EVENT_CLEAR_FEATURE_DEVICE:
+      if (dev->dev_req.value != DEVICE_REMOTE_WAKEUP)
+	usb_lld_ctrl_error (dev);
+      else
+	{
+	  dev->feature &= ~USB_REMOTE_WAKEUP;
+	  usb_lld_ctrl_ack (dev);
+	}
+      break;
+
+    case USB_EVENT_SET_FEATURE_ENDPOINT:
     case USB_EVENT_CLEAR_FEATURE_ENDPOINT:
       usb_lld_ctrl_ack (dev);
       break;
@@ -193,13 +321,25 @@ usb_event_handle (struct usb_dev *dev)
     case USB_EVENT_DEVICE_SUSPEND:
       led_blink (LED_OFF);
       chopstx_usec_wait (10);	/* Make sure LED off */
-      chopstx_conf_idle (2);
+      /* Stop mode halts the USARTs and the timebase, input couldn't
+	 wake the host.  */
+      chopstx_conf_idle ((dev->feature & USB_REMOTE_WAKEUP) ? 1 : 2);
       bDeviceState |= USB_DEVICE_STATE_SUSPEND;
+      usb_wakeup_cancel ();
+      wakeup_at = timebase_now ();
+      hid_suspend (dev->feature & USB_REMOTE_WAKEUP);
       break;
 
     case USB_EVENT_DEVICE_WAKEUP:
       chopstx_conf_idle (1);
       bDeviceState &= ~USB_DEVICE_STATE_SUSPEND;
+      /* Our own resume may show up here, let it run its time.  */
+      if (wakeup_state != WAKEUP_DRIVE)
+	wakeup_state = WAKEUP_NONE;
+      /* The current state, and whatever was held, goes out now, the
+	 endpoints hold the reports until the host polls.  */
+      hid_resume ();
+      hid_input_process ();
       break;
 
     case USB_EVENT_OK:
@@ -210,8 +350,21 @@ usb_event_handle (struct usb_dev *dev)
   return 0;
 }
 
+/* Input events from the serial ports, built into reports here.  */
+static chopstx_poll_cond_t input_poll_desc;
+
+#ifdef DEBUG
+/* Output queued by _write.  */
+static chopstx_poll_cond_t stdout_poll_desc;
+static void stdout_flush (void);
+#endif
+
 static struct chx_poll_head *const usb_poll[] = {
-  (struct chx_poll_head *const)&interrupt
+  (struct chx_poll_head *const)&interrupt,
+  (struct chx_poll_head *const)&input_poll_desc,
+#ifdef DEBUG
+  (struct chx_poll_head *const)&stdout_poll_desc
+#endif
 };
 #define USB_POLL_NUM (sizeof (usb_poll)/sizeof (struct chx_poll_head *))
 
@@ -221,11 +374,16 @@ usb_thread (void *arg)
   uint32_t timeout;
   struct usb_dev dev;
   uint32_t *timeout_p;
+  uint32_t wakeup_timeout;
 
   (void)arg;
 
   chopstx_claim_irq (&interrupt, INTR_REQ_USB);
   usb_lld_init (&dev, USB_INITIAL_FEATURE);
+  input_event_prepare_poll (&input_poll_desc);
+#ifdef DEBUG
+  eventflag_prepare_poll (&stdout.ev, &stdout_poll_desc);
+#endif
 
  reset:
   timeout = USB_TIMEOUT;
@@ -235,12 +393,35 @@ usb_thread (void *arg)
 	timeout_p = &timeout;
       else
 	timeout_p = NULL;
+      wakeup_timeout = usb_wakeup_poll ();
+      if (wakeup_timeout)
+	timeout_p = &wakeup_timeout;
 
+#ifdef DEBUG
+      stdout_flush ();
+#endif
+      cpustat_sleep (CPUSTAT_USB);
       chopstx_poll (timeout_p, USB_POLL_NUM, usb_poll);
+      cpustat_wake (CPUSTAT_USB);
+
+#ifdef DEBUG
+      /* Checked only when things are quiet, it takes a while.  */
+      if (timeout == 0)
+	stack_check ();
+#endif
+
+      /* Input while suspended wakes the host, if it allowed that.  */
+      if (hid_input_process () && (dev.feature & USB_REMOTE_WAKEUP))
+	usb_remote_wakeup ();
 
       if (interrupt.ready)
 	{
-	  if (usb_event_handle (&dev) == 0)
+	  int r;
+
+	  PROF_BEGIN (PROF_USB_EVENT);
+	  r = usb_event_handle (&dev);
+	  PROF_END (PROF_USB_EVENT);
+	  if (r == 0)
 	    continue;
 
 	  /* RESET handling:
@@ -269,51 +450,157 @@ usb_thread (void *arg)
 #ifdef DEBUG
 #include "usb-cdc.h"
 
+/* The USB thread sends from the rings a packet at a time as the
+   endpoint frees up: the ring is the second buffer, the next packet is
+   ready in it while one is in the PMA, and goes from the tx_done of the
+   one before.  While no host has the port open the rings just fill.  */
 void
 stdout_init (void)
 {
-  chopstx_mutex_init (&stdout.m);
-  chopstx_mutex_init (&stdout.m_dev);
-  chopstx_cond_init (&stdout.cond_dev);
-  stdout.connected = 0;
+  eventflag_init (&stdout.ev);
 }
 
-void
-_write (const char *s, int len)
+/* USB thread only.  */
+static void
+stdout_flush (void)
 {
-  int packet_len;
+  struct stdout_ring *r;
+  uint16_t tail;
+  uint16_t len;
+  int i;
 
-  if (len == 0)
+  eventflag_get (&stdout.ev);
+  if (!stdout.connected || stdout.tx_busy)
     return;
 
-  chopstx_mutex_lock (&stdout.m);
-
-  chopstx_mutex_lock (&stdout.m_dev);
-  if (!stdout.connected)
-    chopstx_cond_wait (&stdout.cond_dev, &stdout.m_dev);
-  chopstx_mutex_unlock (&stdout.m_dev);
+  /* Rings take turns, each sending what it held when its turn began.
+     Writes go into a ring whole, so that is always between writes and
+     no write has another thread's output between its packets, yet a
+     steady writer can't keep the others waiting.  */
+  r = &stdout.ring[stdout.cur];
+  if (r->tail == stdout.turn_end)
+    for (i = 0; i < STDOUT_PRODUCERS; i++)
+      {
+	stdout.cur = (stdout.cur + 1) % STDOUT_PRODUCERS;
+	r = &stdout.ring[stdout.cur];
+	stdout.turn_end = r->head;
+	if (r->tail != stdout.turn_end)
+	  break;
+      }
+
+  tail = r->tail;
+  len = stdout.turn_end - tail;
+  if (len == 0 && !stdout.last_full)
+    return;
 
-  do
-    {
-      packet_len =
-	(len < VIRTUAL_COM_PORT_DATA_SIZE) ? len : VIRTUAL_COM_PORT_DATA_SIZE;
+  /* Up to a packet, not across the end of the ring.  Nothing in the
+     packet is given back to the writer until it has gone.  */
+  if (len > VIRTUAL_COM_PORT_DATA_SIZE)
+    len = VIRTUAL_COM_PORT_DATA_SIZE;
+  if (len > STDOUT_RING_SIZE - (tail & (STDOUT_RING_SIZE - 1)))
+    len = STDOUT_RING_SIZE - (tail & (STDOUT_RING_SIZE - 1));
 
-      chopstx_mutex_lock (&stdout.m_dev);
+  stdout.tx_len = len;
+  stdout.tx_busy = 1;
 #ifdef GNU_LINUX_EMULATION
-      usb_lld_tx_enable_buf (ENDP3, s, packet_len);
+  usb_lld_tx_enable_buf (ENDP3, &r->buf[tail & (STDOUT_RING_SIZE - 1)], len);
 #else
-      usb_lld_write (ENDP3, s, packet_len);
+  usb_lld_write (ENDP3, &r->buf[tail & (STDOUT_RING_SIZE - 1)], len);
 #endif
-      chopstx_cond_wait (&stdout.cond_dev, &stdout.m_dev);
-      chopstx_mutex_unlock (&stdout.m_dev);
+}
 
-      s += packet_len;
-      len -= packet_len;
+static void
+stdout_tx_done (void)
+{
+  stdout.ring[stdout.cur].tail += stdout.tx_len;
+  /* A full last packet needs a Zero-Length-Packet after it.  */
+  stdout.last_full = (stdout.tx_len == VIRTUAL_COM_PORT_DATA_SIZE);
+  stdout.tx_len = 0;
+  stdout.tx_busy = 0;
+  stdout_flush ();
+}
+
+/* On a new configuration: anything in flight went with the old one.  */
+void
+stdout_tx_reset (void)
+{
+  stdout.tx_len = 0;
+  stdout.tx_busy = 0;
+  stdout.last_full = 0;
+}
+
+/* From the DTR the host sets.  The USB thread starts sending what has
+   queued up.  */
+void
+stdout_set_connected (int connected)
+{
+  stdout.connected = connected;
+}
+
+uint32_t
+stdout_get_dropped (void)
+{
+  return __atomic_load_n (&stdout.dropped, __ATOMIC_RELAXED);
+}
+
+/* The calling thread's ring.  Rings are claimed in order and never
+   given back, so a thread finds its own before any free one.  */
+static struct stdout_ring *
+stdout_ring_get (void)
+{
+  chopstx_t self = chopstx_self ();
+  int i;
+
+  for (i = 0; i < STDOUT_PRODUCERS; i++)
+    {
+      struct stdout_ring *r = &stdout.ring[i];
+      chopstx_t owner = r->owner;
+
+      if (owner == self)
+	return r;
+      if (owner == 0
+	  && __atomic_compare_exchange_n (&r->owner, &owner, self, 0,
+					  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	return r;
+    }
+  return NULL;
+}
+
+/* Lock free: only the owner moves head and only the USB thread moves
+   tail.  A write that doesn't fit is dropped whole, so binary trace
+   frames stay intact, and counted in stdout.dropped.  Returns 0 if
+   there was no room and nothing was written.  */
+int
+stdout_write (const char *s, int len)
+{
+  struct stdout_ring *r;
+  uint16_t head;
+  int i;
+
+  if (len == 0)
+    return 1;
+
+  r = stdout_ring_get ();
+  head = r ? r->head : 0;
+  if (r == NULL || len > STDOUT_RING_SIZE - (uint16_t)(head - r->tail))
+    {
+      __atomic_fetch_add (&stdout.dropped, len, __ATOMIC_RELAXED);
+      return 0;
     }
-  /* Send a Zero-Length-Packet if the last packet is full size.  */
-  while (len != 0 || packet_len == VIRTUAL_COM_PORT_DATA_SIZE);
+  for (i = 0; i < len; i++)
+    r->buf[(head + i) & (STDOUT_RING_SIZE - 1)] = s[i];
+  /* The bytes must be in place before the USB thread can see them.  */
+  __sync_synchronize ();
+  r->head = head + len;
+
+  eventflag_signal (&stdout.ev, 1);
+  return 1;
+}
 
-  chopstx_mutex_unlock (&stdout.m);
+void
+_write (const char *s, int len)
+{
+  stdout_write (s, len);
 }
 
 #else
@@ -21,6 +21,12 @@
 #else
 #define USB_INITIAL_FEATURE 0x80   /* bmAttributes: bus powered */
 #endif
+/* bmAttributes, and the bit in usb_dev.feature while the host allows it */
+#define USB_REMOTE_WAKEUP 0x20
+
+/* Interrupt IN polling interval of both HID endpoints, in ms */
+void usb_desc_set_hid_interval (uint8_t ms);
+uint8_t usb_desc_get_hid_interval (void);
 
 /* Control pipe */
 /* EP0: 64-byte, 64-byte  */
@@ -34,11 +40,11 @@
 #define ENDP2_TXADDR        (0xc8)
 
 /* CDC BULK_IN, INTR_IN, BULK_OUT */
-/* EP3: 16-byte  */
+/* EP3: 64-byte  */
 #define ENDP3_TXADDR        (0xd0)
 /* EP4: 8-byte */
-#define ENDP4_TXADDR        (0xe0)
-/* EP5: 16-byte */
-#define ENDP5_RXADDR        (0xe8)
+#define ENDP4_TXADDR        (0x110)
+/* EP5: 64-byte, up to 0x158 of the 0x200 */
+#define ENDP5_RXADDR        (0x118)
 
 #endif /* __USB_CONF_H */
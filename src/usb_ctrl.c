@@ -45,6 +45,11 @@ void led_blink(int spec);
 #endif
 
 #include "usb_hid.h"
+#include "sun_usart_stats.h"
+#include "trace.h"
+#include "prof.h"
+#include "stackmon.h"
+#include "cpustat.h"
 
 #ifdef ENABLE_VIRTUAL_COM_PORT
 #include "usb-cdc.h"
@@ -127,6 +132,7 @@ setup_endpoints_for_interface (struct usb_dev *dev,
 	  usb_lld_setup_endpoint (ENDP5, EP_BULK, 0, ENDP5_RXADDR, 0,
 				  VIRTUAL_COM_PORT_DATA_SIZE);
 #endif
+	  stdout_tx_reset ();
 	}
       else
 	{
@@ -163,6 +169,25 @@ uint8_t * sram_address(uint32_t offset);
 #define USB_FSIJ_GNUK_DOWNLOAD    1
 #define USB_FSIJ_GNUK_EXEC        2
 
+/* wValue is the USART number, 1 to 3 */
+#define USB_SUNHID_GET_STATS      0x40
+/* wIndex:wValue is the sequence number of the first record wanted */
+#define USB_SUNHID_GET_TRACE      0x41
+/* A GET reads the latency histograms of HID interface wValue, a SET
+ * with no data clears them all */
+#define USB_SUNHID_LATENCY        0x42
+/* The same for the profiling zones, see prof.h */
+#define USB_SUNHID_PROFILE        0x43
+/* Stack usage of each thread, see stackmon.h */
+#define USB_SUNHID_GET_STACKS     0x44
+/* CPU time by thread and idle time, GET and SET like the latency */
+#define USB_SUNHID_CPU            0x45
+/* Bytes of debug output dropped with the console rings full */
+#define USB_SUNHID_GET_LOG_DROPPED 0x46
+
+/* One EP0 packet of trace records, it has to outlive the request */
+static uint32_t trace_reply[64 / 4];
+
 #ifdef FLASH_UPGRADE_SUPPORT
 /* After calling this function, CRC module remain enabled.  */
 static int
@@ -193,6 +218,54 @@ usb_setup (struct usb_dev *dev)
     {
       if (USB_SETUP_GET (arg->type))
 	{
+	  if (arg->request == USB_SUNHID_GET_STATS)
+	    {
+	      struct sun_usart_stats *stats = sun_usart_get_stats (arg->value);
+
+	      if (stats == NULL)
+		return -1;
+	      return usb_lld_ctrl_send (dev, stats, sizeof (*stats));
+	    }
+	  if (arg->request == USB_SUNHID_GET_TRACE)
+	    {
+	      int len = arg->len < sizeof (trace_reply)
+		? arg->len : sizeof (trace_reply);
+
+	      len = trace_read (((uint32_t)arg->index << 16) | arg->value,
+				trace_reply, len);
+	      if (len < 0)
+		return -1;
+	      return usb_lld_ctrl_send (dev, trace_reply, len);
+	    }
+	  if (arg->request == USB_SUNHID_LATENCY)
+	    {
+	      struct hid_latency *latency = hid_get_latency (arg->value);
+
+	      if (latency == NULL)
+		return -1;
+	      return usb_lld_ctrl_send (dev, latency, sizeof (*latency));
+	    }
+#ifdef DEBUG
+	  if (arg->request == USB_SUNHID_GET_LOG_DROPPED)
+	    {
+	      /* Has to outlive the request, like trace_reply */
+	      static uint32_t dropped;
+
+	      dropped = stdout_get_dropped ();
+	      return usb_lld_ctrl_send (dev, &dropped, sizeof (dropped));
+	    }
+#endif
+	  if (arg->request == USB_SUNHID_CPU)
+	    return usb_lld_ctrl_send (dev, cpustat_get (),
+				      sizeof (struct cpustat));
+	  if (arg->request == USB_SUNHID_GET_STACKS)
+	    return usb_lld_ctrl_send (dev, stack_get_usage (),
+				      STACK_ID_NUM * sizeof (struct stack_usage));
+#ifdef PROFILE
+	  if (arg->request == USB_SUNHID_PROFILE)
+	    return usb_lld_ctrl_send (dev, prof_get_zones (),
+				      PROF_NUM_ZONES * sizeof (struct prof_zone));
+#endif
 #ifdef FLASH_UPGRADE_SUPPORT
 	  if (arg->request == USB_FSIJ_GNUK_MEMINFO)
 	    return usb_lld_ctrl_send (dev, mem_info, sizeof (mem_info));
@@ -224,6 +297,23 @@ usb_setup (struct usb_dev *dev)
 	      return -1;
 #endif
 	    }
+	  else if (arg->request == USB_SUNHID_LATENCY && arg->len == 0)
+	    {
+	      hid_reset_latency ();
+	      return usb_lld_ctrl_ack (dev);
+	    }
+	  else if (arg->request == USB_SUNHID_CPU && arg->len == 0)
+	    {
+	      cpustat_reset ();
+	      return usb_lld_ctrl_ack (dev);
+	    }
+#ifdef PROFILE
+	  else if (arg->request == USB_SUNHID_PROFILE && arg->len == 0)
+	    {
+	      prof_reset ();
+	      return usb_lld_ctrl_ack (dev);
+	    }
+#endif
 	  else if (arg->request == USB_FSIJ_GNUK_EXEC && arg->len == 0)
 	    {
 #ifdef FLASH_UPGRADE_SUPPORT
@@ -284,25 +374,8 @@ usb_ctrl_write_finish (struct usb_dev *dev)
       else if (arg->index == VCOM_INTERFACE_0 && USB_SETUP_SET (arg->type)
 	  && arg->request == USB_CDC_REQ_SET_CONTROL_LINE_STATE)
 	{
-	  uint8_t connected_saved = stdout.connected;
-
-	  if ((arg->value & CDC_CTRL_DTR) != 0)
-	    {
-	      if (stdout.connected == 0)
-		/* It's Open call */
-		stdout.connected++;
-	    }
-	  else
-	    {
-	      if (stdout.connected)
-		/* Close call */
-		stdout.connected = 0;
-	    }
-
-	  chopstx_mutex_lock (&stdout.m_dev);
-	  if (stdout.connected != connected_saved)
-	    chopstx_cond_signal (&stdout.cond_dev);
-	  chopstx_mutex_unlock (&stdout.m_dev);
+	  /* DTR is set on open and cleared on close.  */
+	  stdout_set_connected ((arg->value & CDC_CTRL_DTR) != 0);
 	}
 #endif
     }
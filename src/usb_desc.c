@@ -12,7 +12,6 @@
 #include "usb_conf.h"
 #include "usb-cdc.h"
 
-#define W_LENGTH(x) ((x)&0xFF), (((x)>>8)&0xFF)
 
 /* Keyboard HID report descriptor. */
 #define KEYB_HID_REPORT_DESC_SIZE (sizeof(keyb_report_desc))
@@ -52,7 +51,8 @@ static const uint8_t keyb_report_desc[] = {
   0xc0		    /* END_COLLECTION */
 };
 
-/* Mouse HID report descriptor. */
+/* Mouse HID report descriptor.  In boot protocol only the first three
+ * bytes (buttons, 8-bit X and Y) are sent, see usb_hid.c */
 #define MOUSE_HID_REPORT_DESC_SIZE (sizeof(mouse_report_desc))
 
 static const uint8_t mouse_report_desc[] = {
@@ -72,39 +72,58 @@ static const uint8_t mouse_report_desc[] = {
   0x95, 0x01,	    /*     REPORT_COUNT (1) */
   0x75, 0x05,	    /*     REPORT_SIZE (5) */
   0x81, 0x01,	    /*     INPUT (Constant) */
-  0x75, 0x08,	    /*     REPORT_SIZE (8) */
-#if defined(MOUSE_WHEEL)
-  0x95, 0x03,	    /*     REPORT_COUNT (3) */
-#else
+  0x75, 0x10,	    /*     REPORT_SIZE (16) */
   0x95, 0x02,	    /*     REPORT_COUNT (2) */
-#endif
   0x05, 0x01,	    /*     USAGE_PAGE (Generic Desktop) */
   0x09, 0x30,	    /*     USAGE (X) */
   0x09, 0x31,	    /*     USAGE (Y) */
+  0x16, 0x01, 0x80, /*     LOGICAL_MINIMUM (-32767) */
+  0x26, 0xff, 0x7f, /*     LOGICAL_MAXIMUM (32767) */
+  0x81, 0x06,	    /*     INPUT (Data, Variable, Relative) */
+#if defined(MOUSE_WHEEL) || defined(MOUSE_PAN)
+  /* Hosts that set the multiplier get wheel and pan in 1/8 detents,
+   * must match HID_MOUSE_WHEEL_RES_SHIFT in usb_hid.h */
+  0xa1, 0x02,	    /*     COLLECTION (Logical) */
+  0x09, 0x48,	    /*       USAGE (Resolution Multiplier) */
+  0x15, 0x00,	    /*       LOGICAL_MINIMUM (0) */
+  0x25, 0x01,	    /*       LOGICAL_MAXIMUM (1) */
+  0x35, 0x01,	    /*       PHYSICAL_MINIMUM (1) */
+  0x45, 0x08,	    /*       PHYSICAL_MAXIMUM (8) */
+  0x75, 0x02,	    /*       REPORT_SIZE (2) */
+  0x95, 0x01,	    /*       REPORT_COUNT (1) */
+  0xb1, 0x02,	    /*       FEATURE (Data, Variable, Absolute) */
+  0x35, 0x00,	    /*       PHYSICAL_MINIMUM (0) */
+  0x45, 0x00,	    /*       PHYSICAL_MAXIMUM (0) */
+  0x75, 0x06,	    /*       REPORT_SIZE (6) */
+  0xb1, 0x01,	    /*       FEATURE (Constant) */
 #if defined(MOUSE_WHEEL)
-  0x09, 0x38,	    /*     USAGE (Wheel) */
+  0x75, 0x10,	    /*       REPORT_SIZE (16) */
+  0x09, 0x38,	    /*       USAGE (Wheel) */
+  0x16, 0x01, 0x80, /*       LOGICAL_MINIMUM (-32767) */
+  0x26, 0xff, 0x7f, /*       LOGICAL_MAXIMUM (32767) */
+  0x81, 0x06,	    /*       INPUT (Data, Variable, Relative) */
 #endif
-  0x15, 0x81,	    /*     LOGICAL_MINIMUM (-127) */
-  0x25, 0x7f,	    /*     LOGICAL_MAXIMUM (127) */
-  0x81, 0x06,	    /*     INPUT (Data, Variable, Relative) */
 #if defined(MOUSE_PAN)
-  0x75, 0x08,	    /*     REPORT_SIZE (8) */
-  0x95, 0x01,	    /*     REPORT_COUNT (1) */
-  0x05, 0x0c,	    /*     USAGE_PAGE (Consumer Devices) */
-  0x0a, 0x38, 0x02  /*     USAGE (AC Pan) */
-  0x15, 0x81,	    /*     LOGICAL_MINIMUM (-127) */
-  0x25, 0x7f,	    /*     LOGICAL_MAXIMUM (127) */
-  0x81, 0x06,	    /*     INPUT (Data, Variable, Relative) */
+  0x75, 0x08,	    /*       REPORT_SIZE (8) */
+  0x05, 0x0c,	    /*       USAGE_PAGE (Consumer Devices) */
+  0x0a, 0x38, 0x02, /*       USAGE (AC Pan) */
+  0x15, 0x81,	    /*       LOGICAL_MINIMUM (-127) */
+  0x25, 0x7f,	    /*       LOGICAL_MAXIMUM (127) */
+  0x81, 0x06,	    /*       INPUT (Data, Variable, Relative) */
 #endif
+  0xc0,		    /*     END_COLLECTION */
+#endif
+#if !defined(MOUSE_WHEEL) || !defined(MOUSE_PAN)
   0x75, 0x08,	    /*     REPORT_SIZE (8) */
-#if defined(MOUSE_WHEEL) && defined(MOUSE_PAN)
-  0x95, 0x03,	    /*     REPORT_COUNT (3) */
-#elif defined(MOUSE_WHEEL) || defined(MOUSE_PAN)
-  0x95, 0x04,	    /*     REPORT_COUNT (4) */
+#if defined(MOUSE_WHEEL)
+  0x95, 0x01,	    /*     REPORT_COUNT (1) */
+#elif defined(MOUSE_PAN)
+  0x95, 0x02,	    /*     REPORT_COUNT (2) */
 #else
-  0x95, 0x05,	    /*     REPORT_COUNT (5) */
+  0x95, 0x03,	    /*     REPORT_COUNT (3) */
 #endif
   0x81, 0x01,	    /*     INPUT (Constant) */
+#endif
   0xc0,		    /*   END_COLLECTION */
   0xc0		    /* END_COLLECTION */
 };
@@ -128,162 +147,260 @@ uint8_t device_desc[] = {
   0x01    /* bNumConfigurations */
 };
 
+/* The configuration descriptor is built from a struct per descriptor
+ * type, so its length and the offsets into it come from the compiler.
+ * Multi-byte fields are little endian, like the bus and both targets.  */
+struct config_descriptor
+{
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint16_t wTotalLength;
+  uint8_t bNumInterfaces;
+  uint8_t bConfigurationValue;
+  uint8_t iConfiguration;
+  uint8_t bmAttributes;
+  uint8_t bMaxPower;
+} __attribute__ ((packed));
+
+struct interface_descriptor
+{
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint8_t bInterfaceNumber;
+  uint8_t bAlternateSetting;
+  uint8_t bNumEndpoints;
+  uint8_t bInterfaceClass;
+  uint8_t bInterfaceSubClass;
+  uint8_t bInterfaceProtocol;
+  uint8_t iInterface;
+} __attribute__ ((packed));
+
+struct endpoint_descriptor
+{
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint8_t bEndpointAddress;
+  uint8_t bmAttributes;
+  uint16_t wMaxPacketSize;
+  uint8_t bInterval;
+} __attribute__ ((packed));
+
+struct hid_descriptor
+{
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint16_t bcdHID;
+  uint8_t bCountryCode;
+  uint8_t bNumDescriptors;
+  uint8_t bClassDescriptorType;
+  uint16_t wClassDescriptorLength;
+} __attribute__ ((packed));
+
+/* A boot protocol HID interface with one interrupt IN endpoint */
+struct hid_interface
+{
+  struct interface_descriptor interface;
+  struct hid_descriptor hid;
+  struct endpoint_descriptor ep_in;
+} __attribute__ ((packed));
+
+#define USB_DT_HID			0x21
+#define USB_DT_REPORT			0x22
+#define USB_DT_PHYSICAL			0x23
+
+#define INTERFACE_DESC(num, n_ep, class, subclass, protocol) {	\
+    .bLength = sizeof (struct interface_descriptor),		\
+    .bDescriptorType = INTERFACE_DESCRIPTOR,			\
+    .bInterfaceNumber = (num),					\
+    .bNumEndpoints = (n_ep),					\
+    .bInterfaceClass = (class),					\
+    .bInterfaceSubClass = (subclass),				\
+    .bInterfaceProtocol = (protocol),				\
+  }
+
+#define ENDPOINT_DESC(addr, attr, size, interval) {		\
+    .bLength = sizeof (struct endpoint_descriptor),		\
+    .bDescriptorType = ENDPOINT_DESCRIPTOR,			\
+    .bEndpointAddress = (addr),					\
+    .bmAttributes = (attr),					\
+    .wMaxPacketSize = (size),					\
+    .bInterval = (interval),					\
+  }
+
+/* Class 3 HID, subclass 1 boot interface, interrupt IN every 10ms
+   until usb_desc_set_hid_interval says otherwise */
+#define HID_INTERFACE_DESC(num, protocol, report_size, ep_addr) {	\
+    .interface = INTERFACE_DESC ((num), 1, 0x03, 0x01, (protocol)),	\
+    .hid = {								\
+      .bLength = sizeof (struct hid_descriptor),			\
+      .bDescriptorType = USB_DT_HID,					\
+      .bcdHID = 0x0110,							\
+      .bNumDescriptors = 1,						\
+      .bClassDescriptorType = USB_DT_REPORT,				\
+      .wClassDescriptorLength = (report_size),				\
+    },									\
+    .ep_in = ENDPOINT_DESC ((ep_addr), 0x03, 8, 0x0A),			\
+  }
+
 #ifdef ENABLE_VIRTUAL_COM_PORT
-#define VCOM_TOTAL_LENGTH (8+9+5+5+4+5+7+9+7+7)
-#else
-#define VCOM_TOTAL_LENGTH   0
-#endif
+struct iad_descriptor
+{
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint8_t bFirstInterface;
+  uint8_t bInterfaceCount;
+  uint8_t bFunctionClass;
+  uint8_t bFunctionSubClass;
+  uint8_t bFunctionProtocol;
+  uint8_t iFunction;
+} __attribute__ ((packed));
+
+/* CDC functional descriptors */
+struct cdc_header_descriptor
+{
+  uint8_t bFunctionLength;
+  uint8_t bDescriptorType;
+  uint8_t bDescriptorSubtype;
+  uint16_t bcdCDC;
+} __attribute__ ((packed));
 
-#define HID_TOTAL_LENGTH (9+9+7)
+struct cdc_call_mgmt_descriptor
+{
+  uint8_t bFunctionLength;
+  uint8_t bDescriptorType;
+  uint8_t bDescriptorSubtype;
+  uint8_t bmCapabilities;
+  uint8_t bDataInterface;
+} __attribute__ ((packed));
 
-#define TOTAL_LENGTH (9+HID_TOTAL_LENGTH*2+VCOM_TOTAL_LENGTH)
+struct cdc_acm_descriptor
+{
+  uint8_t bFunctionLength;
+  uint8_t bDescriptorType;
+  uint8_t bDescriptorSubtype;
+  uint8_t bmCapabilities;
+} __attribute__ ((packed));
 
+struct cdc_union_descriptor
+{
+  uint8_t bFunctionLength;
+  uint8_t bDescriptorType;
+  uint8_t bDescriptorSubtype;
+  uint8_t bMasterInterface;
+  uint8_t bSlaveInterface0;
+} __attribute__ ((packed));
 
-/* Configuation Descriptor */
-static const uint8_t config_desc[] = {
-  9,			   /* bLength: Configuation Descriptor size */
-  CONFIG_DESCRIPTOR,	   /* bDescriptorType: Configuration */
-  W_LENGTH(TOTAL_LENGTH),  /* wTotalLength:no of returned bytes */
-  NUM_INTERFACES,	   /* bNumInterfaces: */
-  0x01,   /* bConfigurationValue: Configuration value */
-  0x00,   /* iConfiguration: Index of string descriptor describing the configuration */
-  USB_INITIAL_FEATURE,  /* bmAttributes*/
-  50,	  /* MaxPower 100 mA */
-
-  /* Interface Descriptor */
-  9,			      /* bLength: Interface Descriptor size */
-  INTERFACE_DESCRIPTOR,	      /* bDescriptorType: Interface */
-  HID_INTERFACE_0,	 /* bInterfaceNumber: Index of Interface */
-  0x00,		  /* bAlternateSetting: Alternate setting */
-  0x01,		  /* bNumEndpoints: One endpoints used */
-  0x03,		  /* bInterfaceClass: HID Class */
-  0x01,		  /* bInterfaceSubClass: Boot interface subclass */
-  0x01,		  /* bInterfaceProtocol: Keyboard */
-  0x00,		  /* iInterface: */
-
-  /* HID Descriptor */
-  9,	        /* bLength: HID Descriptor size */
-  0x21,	        /* bDescriptorType: HID */
-  0x10, 0x01,   /* bcdHID: HID Class Spec release number */
-  0x00,	        /* bCountryCode: Hardware target country */
-  0x01,         /* bNumDescriptors: Number of HID class descriptors to follow */
-  0x22,         /* bDescriptorType */
-  W_LENGTH(KEYB_HID_REPORT_DESC_SIZE), /* wItemLength: Total length of Report descriptor */
-
-  /*Endpoint IN1 Descriptor*/
-  7,                            /* bLength: Endpoint Descriptor size */
-  ENDPOINT_DESCRIPTOR,		/* bDescriptorType: Endpoint */
-  0x81,				/* bEndpointAddress: (IN1) */
-  0x03,				/* bmAttributes: Interrupt */
-  W_LENGTH(8),			/* wMaxPacketSize: 8 */
-  0x0A,				/* bInterval (10ms) */
-
-  /* Interface Descriptor */
-  9,			      /* bLength: Interface Descriptor size */
-  INTERFACE_DESCRIPTOR,	      /* bDescriptorType: Interface */
-  HID_INTERFACE_1,	 /* bInterfaceNumber: Index of Interface */
-  0x00,		  /* bAlternateSetting: Alternate setting */
-  0x01,		  /* bNumEndpoints: One endpoints used */
-  0x03,		  /* bInterfaceClass: HID Class */
-  0x01,		  /* bInterfaceSubClass: Boot interface subclass */
-  0x02,		  /* bInterfaceProtocol: Mouse */
-  0x00,		  /* iInterface: */
-
-  /* HID Descriptor */
-  9,	        /* bLength: HID Descriptor size */
-  0x21,	        /* bDescriptorType: HID */
-  0x10, 0x01,   /* bcdHID: HID Class Spec release number */
-  0x00,	        /* bCountryCode: Hardware target country */
-  0x01,         /* bNumDescriptors: Number of HID class descriptors to follow */
-  0x22,         /* bDescriptorType */
-  W_LENGTH(MOUSE_HID_REPORT_DESC_SIZE), /* wItemLength: Total length of Report descriptor */
-
-  /*Endpoint IN1 Descriptor*/
-  7,                            /* bLength: Endpoint Descriptor size */
-  ENDPOINT_DESCRIPTOR,		/* bDescriptorType: Endpoint */
-  0x82,				/* bEndpointAddress: (IN2) */
-  0x03,				/* bmAttributes: Interrupt */
-  W_LENGTH(8),			/* wMaxPacketSize: 8 */
-  0x0A,				/* bInterval (10ms) */
+#define CS_INTERFACE 0x24
 
+/* The virtual COM port: a communication interface with its notification
+ * endpoint and a data interface with the bulk pair */
+struct vcom_function
+{
+  struct iad_descriptor iad;
+  struct interface_descriptor comm;
+  struct cdc_header_descriptor header;
+  struct cdc_call_mgmt_descriptor call_mgmt;
+  struct cdc_acm_descriptor acm;
+  struct cdc_union_descriptor cdc_union;
+  struct endpoint_descriptor ep_notify;
+  struct interface_descriptor data;
+  struct endpoint_descriptor ep_out;
+  struct endpoint_descriptor ep_in;
+} __attribute__ ((packed));
+#endif
+
+struct config_desc
+{
+  struct config_descriptor config;
+  struct hid_interface keyb;
+  struct hid_interface mouse;
 #ifdef ENABLE_VIRTUAL_COM_PORT
-  /* Interface Association Descriptor */
-  8,			      /* bLength: Interface Association Descriptor size */
-  0x0b,			      /* bDescriptorType: Interface Association */
-  VCOM_INTERFACE_0,	      /* bInterfaceNumber of first interface */
-  2,			      /* bInterfaceCount of contiguous interfaces */
-  0x02,			      /* bFunctionClass: Communication Interface Class */
-  0x02,			      /* bFunctionSubClass: Abstract Control Model */
-  0x01,			      /* bInterfaceProtocol: Common AT commands */
-  0x00,			      /* iFunction: */
-
-  /* Interface Descriptor */
-  9,			      /* bLength: Interface Descriptor size */
-  INTERFACE_DESCRIPTOR,	      /* bDescriptorType: Interface */
-  VCOM_INTERFACE_0,	 /* bInterfaceNumber: Index of Interface */
-  0x00,		  /* bAlternateSetting: Alternate setting */
-  0x01,		  /* bNumEndpoints: One endpoints used */
-  0x02,		  /* bInterfaceClass: Communication Interface Class */
-  0x02,		  /* bInterfaceSubClass: Abstract Control Model */
-  0x01,		  /* bInterfaceProtocol: Common AT commands */
-  0x00,		  /* iInterface: */
-  /*Header Functional Descriptor*/
-  5,			    /* bLength: Endpoint Descriptor size */
-  0x24,			    /* bDescriptorType: CS_INTERFACE */
-  0x00,			    /* bDescriptorSubtype: Header Func Desc */
-  0x10, 0x01,		    /* bcdCDC: spec release number */
-  /*Call Managment Functional Descriptor*/
-  5,	    /* bFunctionLength */
-  0x24,	    /* bDescriptorType: CS_INTERFACE */
-  0x01,	    /* bDescriptorSubtype: Call Management Func Desc */
-  0x03,	    /* bmCapabilities: D0+D1 */
-  VCOM_INTERFACE_1,	    /* bDataInterface */
-  /*ACM Functional Descriptor*/
-  4,	    /* bFunctionLength */
-  0x24,	    /* bDescriptorType: CS_INTERFACE */
-  0x02,	    /* bDescriptorSubtype: Abstract Control Management desc */
-  0x02,	    /* bmCapabilities */
-  /*Union Functional Descriptor*/
-  5,		 /* bFunctionLength */
-  0x24,		 /* bDescriptorType: CS_INTERFACE */
-  0x06,		 /* bDescriptorSubtype: Union func desc */
-  VCOM_INTERFACE_0,	 /* bMasterInterface: Communication class interface */
-  VCOM_INTERFACE_1,	 /* bSlaveInterface0: Data Class Interface */
-  /*Endpoint 4 Descriptor*/
-  7,			       /* bLength: Endpoint Descriptor size */
-  ENDPOINT_DESCRIPTOR,	       /* bDescriptorType: Endpoint */
-  0x84,				   /* bEndpointAddress: (IN4) */
-  0x03,				   /* bmAttributes: Interrupt */
-  W_LENGTH(VIRTUAL_COM_PORT_INT_SIZE), /* wMaxPacketSize: */
-  0xFF,				   /* bInterval: */
-
-  /*Data class interface descriptor*/
-  9,			       /* bLength: Endpoint Descriptor size */
-  INTERFACE_DESCRIPTOR,	       /* bDescriptorType: */
-  VCOM_INTERFACE_1,	 /* bInterfaceNumber: Index of Interface */
-  0x00,			   /* bAlternateSetting: Alternate setting */
-  0x02,			   /* bNumEndpoints: Two endpoints used */
-  0x0A,			   /* bInterfaceClass: CDC */
-  0x00,			   /* bInterfaceSubClass: */
-  0x00,			   /* bInterfaceProtocol: */
-  0x00,			   /* iInterface: */
-  /*Endpoint 5 Descriptor*/
-  7,			       /* bLength: Endpoint Descriptor size */
-  ENDPOINT_DESCRIPTOR,	       /* bDescriptorType: Endpoint */
-  0x05,				    /* bEndpointAddress: (OUT5) */
-  0x02,				    /* bmAttributes: Bulk */
-  W_LENGTH(VIRTUAL_COM_PORT_DATA_SIZE), /* wMaxPacketSize: */
-  0x00,			     /* bInterval: ignore for Bulk transfer */
-  /*Endpoint 3 Descriptor*/
-  7,			       /* bLength: Endpoint Descriptor size */
-  ENDPOINT_DESCRIPTOR,	       /* bDescriptorType: Endpoint */
-  0x83,				    /* bEndpointAddress: (IN3) */
-  0x02,				    /* bmAttributes: Bulk */
-  W_LENGTH(VIRTUAL_COM_PORT_DATA_SIZE), /* wMaxPacketSize: */
-  0x00,				    /* bInterval */
+  struct vcom_function vcom;
+#endif
+} __attribute__ ((packed));
+
+/* Configuation Descriptor */
+/* In RAM, for the polling interval */
+static struct config_desc config_desc = {
+  .config = {
+    .bLength = sizeof (struct config_descriptor),
+    .bDescriptorType = CONFIG_DESCRIPTOR,
+    .wTotalLength = sizeof (struct config_desc),
+    .bNumInterfaces = NUM_INTERFACES,
+    .bConfigurationValue = 0x01,
+    .iConfiguration = 0x00,
+    .bmAttributes = USB_INITIAL_FEATURE | USB_REMOTE_WAKEUP,
+    .bMaxPower = 50,			/* 100 mA */
+  },
+  .keyb = HID_INTERFACE_DESC (HID_INTERFACE_0, 0x01 /* Keyboard */,
+			      KEYB_HID_REPORT_DESC_SIZE, 0x81 /* IN1 */),
+  .mouse = HID_INTERFACE_DESC (HID_INTERFACE_1, 0x02 /* Mouse */,
+			       MOUSE_HID_REPORT_DESC_SIZE, 0x82 /* IN2 */),
+#ifdef ENABLE_VIRTUAL_COM_PORT
+  .vcom = {
+    .iad = {
+      .bLength = sizeof (struct iad_descriptor),
+      .bDescriptorType = 0x0b,	/* Interface Association */
+      .bFirstInterface = VCOM_INTERFACE_0,
+      .bInterfaceCount = 2,
+      .bFunctionClass = 0x02,	/* Communication Interface Class */
+      .bFunctionSubClass = 0x02,	/* Abstract Control Model */
+      .bFunctionProtocol = 0x01,	/* Common AT commands */
+    },
+    /* Communication Interface Class, Abstract Control Model, AT commands */
+    .comm = INTERFACE_DESC (VCOM_INTERFACE_0, 1, 0x02, 0x02, 0x01),
+    .header = {
+      .bFunctionLength = sizeof (struct cdc_header_descriptor),
+      .bDescriptorType = CS_INTERFACE,
+      .bDescriptorSubtype = 0x00,
+      .bcdCDC = 0x0110,
+    },
+    .call_mgmt = {
+      .bFunctionLength = sizeof (struct cdc_call_mgmt_descriptor),
+      .bDescriptorType = CS_INTERFACE,
+      .bDescriptorSubtype = 0x01,
+      .bmCapabilities = 0x03,	/* D0+D1 */
+      .bDataInterface = VCOM_INTERFACE_1,
+    },
+    .acm = {
+      .bFunctionLength = sizeof (struct cdc_acm_descriptor),
+      .bDescriptorType = CS_INTERFACE,
+      .bDescriptorSubtype = 0x02,
+      .bmCapabilities = 0x02,
+    },
+    .cdc_union = {
+      .bFunctionLength = sizeof (struct cdc_union_descriptor),
+      .bDescriptorType = CS_INTERFACE,
+      .bDescriptorSubtype = 0x06,
+      .bMasterInterface = VCOM_INTERFACE_0,
+      .bSlaveInterface0 = VCOM_INTERFACE_1,
+    },
+    .ep_notify = ENDPOINT_DESC (0x84 /* IN4 */, 0x03,
+				VIRTUAL_COM_PORT_INT_SIZE, 0xFF),
+    /* CDC data */
+    .data = INTERFACE_DESC (VCOM_INTERFACE_1, 2, 0x0A, 0x00, 0x00),
+    .ep_out = ENDPOINT_DESC (0x05 /* OUT5 */, 0x02,
+			     VIRTUAL_COM_PORT_DATA_SIZE, 0x00),
+    .ep_in = ENDPOINT_DESC (0x83 /* IN3 */, 0x02,
+			    VIRTUAL_COM_PORT_DATA_SIZE, 0x00),
+  },
 #endif
 };
 
+/* The layouts the standards give */
+_Static_assert (sizeof (struct config_descriptor) == 9, "config descriptor");
+_Static_assert (sizeof (struct interface_descriptor) == 9, "interface descriptor");
+_Static_assert (sizeof (struct endpoint_descriptor) == 7, "endpoint descriptor");
+_Static_assert (sizeof (struct hid_descriptor) == 9, "HID descriptor");
+_Static_assert (sizeof (struct hid_interface) == 9+9+7, "HID interface");
+#ifdef ENABLE_VIRTUAL_COM_PORT
+_Static_assert (sizeof (struct iad_descriptor) == 8, "IAD");
+_Static_assert (sizeof (struct vcom_function) == 8+9+5+5+4+5+7+9+7+7,
+		"virtual COM port function");
+#endif
+_Static_assert (sizeof (struct config_desc) < 256,
+		"configuration descriptor");
+
 
 /* USB String Descriptors */
 static const uint8_t sunhid_string_lang_id[] = {
@@ -312,9 +429,20 @@ static const struct desc string_descriptors[] = {
 };
 #define NUM_STRING_DESC (sizeof (string_descriptors) / sizeof (struct desc))
 
-#define USB_DT_HID			0x21
-#define USB_DT_REPORT			0x22
-#define USB_DT_PHYSICAL			0x23
+/* The host only reads it when it enumerates the device, so a new
+   interval takes effect from the next bus reset.  */
+void
+usb_desc_set_hid_interval (uint8_t ms)
+{
+  config_desc.keyb.ep_in.bInterval = ms;
+  config_desc.mouse.ep_in.bInterval = ms;
+}
+
+uint8_t
+usb_desc_get_hid_interval (void)
+{
+  return config_desc.keyb.ep_in.bInterval;
+}
 
 int
 usb_get_descriptor (struct usb_dev *dev)
@@ -329,7 +457,7 @@ usb_get_descriptor (struct usb_dev *dev)
       if (desc_type == DEVICE_DESCRIPTOR)
 	return usb_lld_ctrl_send (dev, device_desc, sizeof (device_desc));
       else if (desc_type == CONFIG_DESCRIPTOR)
-	return usb_lld_ctrl_send (dev, config_desc, sizeof (config_desc));
+	return usb_lld_ctrl_send (dev, &config_desc, sizeof (config_desc));
       else if (desc_type == STRING_DESCRIPTOR)
 	{
 	  if (desc_index < NUM_STRING_DESC)
@@ -366,7 +494,8 @@ usb_get_descriptor (struct usb_dev *dev)
            * descriptors
            */
 	  if (desc_type == USB_DT_HID)
-	    return usb_lld_ctrl_send (dev, config_desc+9+9, 9);
+	    return usb_lld_ctrl_send (dev, &config_desc.keyb.hid,
+				      sizeof (config_desc.keyb.hid));
 	  else if (desc_type == USB_DT_REPORT)
 	    return usb_lld_ctrl_send (dev, keyb_report_desc,
 				      KEYB_HID_REPORT_DESC_SIZE);
@@ -378,7 +507,8 @@ usb_get_descriptor (struct usb_dev *dev)
            * descriptors
            */
 	  if (desc_type == USB_DT_HID)
-	    return usb_lld_ctrl_send (dev, config_desc+9+9+9+7+9, 9);
+	    return usb_lld_ctrl_send (dev, &config_desc.mouse.hid,
+				      sizeof (config_desc.mouse.hid));
 	  else if (desc_type == USB_DT_REPORT)
 	    return usb_lld_ctrl_send (dev, mouse_report_desc,
 				      MOUSE_HID_REPORT_DESC_SIZE);
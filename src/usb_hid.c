@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <chopstx.h>
+#include <eventflag.h>
 
 #include "config.h"
 #include "board.h"
@@ -10,6 +11,10 @@
 #include "usb_lld.h"
 #include "usb_conf.h"
 #include "usb_hid.h"
+#include "timebase.h"
+#include "input_event.h"
+#include "trace.h"
+#include "prof.h"
 
 #include "serial.h"
 
@@ -26,11 +31,6 @@ static struct hid_info
 	uint8_t hid_protocol;
 } hid_info[2] = {{0, 1}, {0, 1}};
 
-static struct hid_locks
-{
-	chopstx_mutex_t tx_mut;
-} hid_locks[2];
-
 static union keyb_hid_report
 {
 	uint64_t raw;
@@ -53,6 +53,32 @@ static union keyb_hid_report
 	};
 } keyb_hid_report;
 
+/* Which input ports hold each key down, one bit per port.  A key is in
+ * the report while any port holds it, so keyboards merge as a union. */
+static uint8_t key_ports[256];
+
+#define KEYB_REPORT_QUEUE_SIZE 4
+
+/* Reports made while one is in flight wait here, so that a quick press
+ * and release both reach the host */
+static struct keyb_state
+{
+	struct {
+		uint64_t raw;
+		uint32_t stamp;
+	} queue[KEYB_REPORT_QUEUE_SIZE];
+	uint8_t head;
+	uint8_t count;
+	uint8_t tx_busy;
+} keyb_state;
+
+static uint8_t keyb_coalesce;
+
+/* While the bus is suspended, or an interface isn't configured, nothing
+ * is written to its endpoint, the reports only track the current state */
+static uint8_t hid_suspended;
+static uint8_t hid_configured;	/* a bit per interface */
+
 static union keyb_output_report
 {
 	uint8_t raw;
@@ -66,6 +92,8 @@ static union keyb_output_report
 	};
 } keyb_output_report;
 
+/* Report protocol mouse report.  X/Y (and the wheel) are 16 bits so a
+ * fast move fits in one report; padded out to the 8 byte endpoint size. */
 static union mouse_hid_report
 {
 	uint64_t raw;
@@ -83,26 +111,88 @@ static union mouse_hid_report
 				uint8_t reserved2:5;
 			};
 		};
-		int8_t x;
-		int8_t y;
+		int16_t x;
+		int16_t y;
 #ifdef MOUSE_WHEEL
-		int8_t wheel;
+		int16_t wheel;
 #endif
 #ifdef MOUSE_PAN
 		int8_t pan;
 #endif
+#if !defined(MOUSE_WHEEL) || !defined(MOUSE_PAN)
 		uint8_t reserved[
-#if defined(MOUSE_WHEEL) && defined(MOUSE_PAN)
-			3
-#elif defined(MOUSE_WHEEL) || defined(MOUSE_PAN)
-			4
+#if defined(MOUSE_WHEEL)
+			1
+#elif defined(MOUSE_PAN)
+			2
 #else
-			5
+			3
 #endif
 			];
-	};
+#endif
+	} __attribute__((packed));
 } mouse_hid_report;
 
+/* Boot protocol mouse report, only the first 3 bytes are defined */
+static struct mouse_boot_report
+{
+	uint8_t buttons;
+	int8_t x;
+	int8_t y;
+} mouse_boot_report;
+
+#if defined(MOUSE_WHEEL) || defined(MOUSE_PAN)
+/* Resolution Multiplier feature report */
+static union mouse_feature_report
+{
+	uint8_t raw;
+	struct {
+		uint8_t resolution_multiplier:2;
+		uint8_t reserved:6;
+	};
+} mouse_feature_report;
+#endif
+
+#define MOUSE_BUTTON_QUEUE_SIZE 4
+#define MOUSE_REPORT_MAX 32767
+#define MOUSE_BOOT_MAX 127
+#define MOUSE_PAN_MAX 127
+
+/* Motion is accumulated here while a report is in flight, and sent as
+ * one report on completion.  Button changes are queued so that a quick
+ * press and release can't be collapsed into no change at all. */
+static struct mouse_state
+{
+	int32_t x;
+	int32_t y;
+#ifdef MOUSE_WHEEL
+	int32_t wheel;
+#endif
+#ifdef MOUSE_PAN
+	int32_t pan;
+#endif
+	uint8_t port_buttons[INPUT_NUM_PORTS];	/* ORed together */
+	uint8_t buttons[MOUSE_BUTTON_QUEUE_SIZE];
+	uint8_t buttons_head;
+	uint8_t buttons_count;
+	uint8_t tx_busy;
+	uint8_t pending;
+	uint32_t stamp;		/* when the oldest unsent input arrived */
+} mouse_state;
+
+/* Timing of the last report on each interrupt endpoint, in timebase
+ * microseconds: when the oldest input in it arrived, when it was handed
+ * to the hardware and when the host took it. */
+static struct hid_timing
+{
+	uint32_t event;
+	uint32_t queued;
+	uint32_t acked;
+	uint8_t busy;
+} hid_timing[2];
+
+static struct hid_latency hid_latency[2];
+
 static const struct endpoint_info
 {
 	uint8_t ep_num;
@@ -127,32 +217,144 @@ void hid_setup_endpoints(struct usb_dev *dev,
 		 * This seems like as good a place for intialization as any */
 		hid_info[interface - HID_INTERFACE_0].hid_idle_rate = 0;
 		hid_info[interface - HID_INTERFACE_0].hid_protocol = 1;
+		hid_timing[interface - HID_INTERFACE_0].busy = 0;
+		hid_configured |= 1 << (interface - HID_INTERFACE_0);
+		if (interface == HID_INTERFACE_0)
+			memset(&keyb_state, 0, sizeof(keyb_state));
+		else
+		{
+			memset(&mouse_state, 0, sizeof(mouse_state));
+#if defined(MOUSE_WHEEL) || defined(MOUSE_PAN)
+			mouse_feature_report.raw = 0;
+#endif
+		}
 	}
 	else
 	{
+		hid_configured &= ~(1 << (interface - HID_INTERFACE_0));
 		usb_lld_stall_tx (endpoint_info[interface - HID_INTERFACE_0].ep_num);
 	}
 }
 
+static void hid_mouse_flush(void);
+static void hid_keyb_send(const uint64_t *raw, uint32_t stamp);
+
+/* A report that replaces one still in flight also carries the older
+ * input. */
+static void hid_report_queued(int n, uint32_t event)
+{
+	if (!hid_timing[n].busy)
+		hid_timing[n].event = event;
+	hid_timing[n].queued = timebase_now();
+	hid_timing[n].busy = 1;
+}
+
+static void hid_latency_count(uint32_t *hist, uint32_t usec)
+{
+	int bucket = usec ? 32 - __builtin_clz(usec) : 0;
+	if (bucket >= HID_LATENCY_BUCKETS)
+		bucket = HID_LATENCY_BUCKETS - 1;
+	++hist[bucket];
+}
+
+static void hid_report_acked(int n)
+{
+	hid_timing[n].acked = timebase_now();
+	if (hid_timing[n].busy)
+	{
+		hid_latency_count(hid_latency[n].queued, hid_timing[n].queued - hid_timing[n].event);
+		hid_latency_count(hid_latency[n].acked, hid_timing[n].acked - hid_timing[n].queued);
+	}
+	hid_timing[n].busy = 0;
+}
+
+/* Only the USB thread touches these, but a read that spans packets can
+ * see counts made between them */
+struct hid_latency *hid_get_latency(uint16_t interface)
+{
+	if (interface != HID_INTERFACE_0 && interface != HID_INTERFACE_1)
+		return NULL;
+	return &hid_latency[interface - HID_INTERFACE_0];
+}
+
+void hid_set_keyb_coalesce(int on)
+{
+	keyb_coalesce = on;
+}
+
+int hid_get_keyb_coalesce(void)
+{
+	return keyb_coalesce;
+}
+
+void hid_reset_latency(void)
+{
+	memset(hid_latency, 0, sizeof(hid_latency));
+}
+
 void hid_tx_done(uint8_t ep_num, uint16_t len)
 {
 	(void)len;
+	if (ep_num == ENDP1)
+	{
+		hid_report_acked(0);
+		keyb_state.tx_busy = 0;
+		if (keyb_state.count)
+		{
+			hid_keyb_send(&keyb_state.queue[keyb_state.head].raw, keyb_state.queue[keyb_state.head].stamp);
+			keyb_state.head = (keyb_state.head + 1) % KEYB_REPORT_QUEUE_SIZE;
+			--keyb_state.count;
+		}
+	}
+	else if (ep_num == ENDP2)
+	{
+		hid_report_acked(1);
+		mouse_state.tx_busy = 0;
+		hid_mouse_flush();
+	}
 }
 
-static void hid_keyb_write(void)
+static void hid_keyb_send(const uint64_t *raw, uint32_t stamp)
 {
+	hid_report_queued(0, stamp);
+	trace_record_data(TRACE_REPORT, (ENDP1 << 8) | sizeof(*raw), raw, sizeof(*raw), timebase_now());
 #ifdef GNU_LINUX_EMULATION
-	usb_lld_tx_enable_buf (ENDP1, &keyb_hid_report, sizeof(keyb_hid_report));
+	usb_lld_tx_enable_buf (ENDP1, raw, sizeof(*raw));
 #else
-	usb_lld_write (ENDP1, &keyb_hid_report, sizeof(keyb_hid_report));
+	usb_lld_write (ENDP1, raw, sizeof(*raw));
 #endif
+	keyb_state.tx_busy = 1;
 }
 
-int hid_key_pressed(uint8_t hidcode)
+static void hid_keyb_write(uint32_t stamp)
+{
+	if (hid_suspended || !(hid_configured & 1))
+		return;
+	if (!keyb_state.tx_busy)
+	{
+		hid_keyb_send(&keyb_hid_report.raw, stamp);
+		return;
+	}
+	/* when full, the newest report is replaced but keeps its stamp */
+	if (keyb_state.count < (keyb_coalesce ? 1 : KEYB_REPORT_QUEUE_SIZE))
+	{
+		++keyb_state.count;
+		keyb_state.queue[(keyb_state.head + keyb_state.count - 1) % KEYB_REPORT_QUEUE_SIZE].stamp = stamp;
+	}
+	keyb_state.queue[(keyb_state.head + keyb_state.count - 1) % KEYB_REPORT_QUEUE_SIZE].raw = keyb_hid_report.raw;
+}
+
+static int hid_key_pressed(uint8_t port, uint8_t hidcode, uint32_t stamp)
 {
 	int ret = 0;
-	chopstx_mutex_lock(&hid_locks[0].tx_mut);
-	if (hidcode >= 0xe0 && hidcode <= 0xe7)
+	uint8_t held;
+	held = key_ports[hidcode];
+	key_ports[hidcode] |= 1 << port;
+	if (held)
+	{
+		/* already down on another port */
+	}
+	else if (hidcode >= 0xe0 && hidcode <= 0xe7)
 	{
 		uint8_t mask = 1 << (hidcode-0xe0);
 		if (!(keyb_hid_report.modifiers & mask))
@@ -194,16 +396,19 @@ int hid_key_pressed(uint8_t hidcode)
 	}
 
 	if (ret == 1)
-		hid_keyb_write();
-	chopstx_mutex_unlock(&hid_locks[0].tx_mut);
+		hid_keyb_write(stamp);
 	return ret;
 }
 
-int hid_key_released(uint8_t hidcode)
+static int hid_key_released(uint8_t port, uint8_t hidcode, uint32_t stamp)
 {
 	int ret = 0;
-	chopstx_mutex_lock(&hid_locks[0].tx_mut);
-	if (hidcode >= 0xe0 && hidcode <= 0xe7)
+	key_ports[hidcode] &= ~(1 << port);
+	if (key_ports[hidcode])
+	{
+		/* still down on another port */
+	}
+	else if (hidcode >= 0xe0 && hidcode <= 0xe7)
 	{
 		uint8_t mask = 1 << (hidcode-0xe0);
 		if (keyb_hid_report.modifiers & mask)
@@ -239,119 +444,232 @@ int hid_key_released(uint8_t hidcode)
 	}
 
 	if (ret == 1)
-		hid_keyb_write();
-	chopstx_mutex_unlock(&hid_locks[0].tx_mut);
+		hid_keyb_write(stamp);
 	return ret;
 }
 
-int hid_key_releaseAll(void)
+/* Only the keys this port held are released.  Not per keystroke, so
+ * walking the whole table is fine. */
+static int hid_key_releaseAll(uint8_t port, uint32_t stamp)
 {
 	int ret = 0;
-	chopstx_mutex_lock(&hid_locks[0].tx_mut);
-	if (keyb_hid_report.raw != 0)
+	for (unsigned int i = 0; i < sizeof(key_ports); ++i)
+		key_ports[i] &= ~(1 << port);
+	for (int i = 0; i < 8; ++i)
+	{
+		uint8_t mask = 1 << i;
+		if ((keyb_hid_report.modifiers & mask) && !key_ports[0xe0 + i])
+		{
+			keyb_hid_report.modifiers &= ~mask;
+			ret = 1;
+		}
+	}
+	for (int i = 0; i < 6; ++i)
 	{
-		ret = 1;
-		keyb_hid_report.raw = 0;
-		hid_keyb_write();
+		if (keyb_hid_report.keycodes[i] != 0 && !key_ports[keyb_hid_report.keycodes[i]])
+		{
+			keyb_hid_report.keycodes[i] = 0;
+			ret = 1;
+		}
 	}
-	chopstx_mutex_unlock(&hid_locks[0].tx_mut);
+	if (ret)
+		hid_keyb_write(stamp);
 	return ret;
 }
 
+static void hid_mouse_boot_fill(void)
+{
+	mouse_boot_report.buttons = mouse_hid_report.raw_buttons;
+	mouse_boot_report.x = mouse_hid_report.x;
+	mouse_boot_report.y = mouse_hid_report.y;
+}
+
 static void hid_mouse_write(void)
 {
+	const void *report = &mouse_hid_report;
+	size_t len = sizeof(mouse_hid_report);
+	if (hid_info[1].hid_protocol == 0)
+	{
+		hid_mouse_boot_fill();
+		report = &mouse_boot_report;
+		len = sizeof(mouse_boot_report);
+	}
+	trace_record_data(TRACE_REPORT, (ENDP2 << 8) | len, report, len, timebase_now());
 #ifdef GNU_LINUX_EMULATION
-	usb_lld_tx_enable_buf (ENDP2, &mouse_hid_report, sizeof(mouse_hid_report));
+	usb_lld_tx_enable_buf (ENDP2, report, len);
 #else
-	usb_lld_write (ENDP2, &mouse_hid_report, sizeof(mouse_hid_report));
+	usb_lld_write (ENDP2, report, len);
 #endif
 }
 
-int hid_mouse_move(int8_t x, int8_t y)
+static int16_t hid_mouse_take(int32_t *acc, int32_t limit)
 {
-	int ret = 0;
-	chopstx_mutex_lock(&hid_locks[1].tx_mut);
+	int32_t v = *acc;
+	if (v > limit)
+		v = limit;
+	else if (v < -limit)
+		v = -limit;
+	*acc -= v;
+	return v;
+}
+
+#if defined(MOUSE_WHEEL) || defined(MOUSE_PAN)
+/* Wheel and pan are accumulated in 1/8 detents.  Unless the host has set
+ * the Resolution Multiplier only whole detents are sent, rounded towards
+ * zero with the rest carried. */
+static int16_t hid_mouse_take_scroll(int32_t *acc, int32_t limit)
+{
+	int32_t v;
+	if (mouse_feature_report.resolution_multiplier)
+		return hid_mouse_take(acc, limit);
+	if (*acc >= 0)
+		v = *acc >> HID_MOUSE_WHEEL_RES_SHIFT;
+	else
+		v = -((-*acc) >> HID_MOUSE_WHEEL_RES_SHIFT);
+	if (v > limit)
+		v = limit;
+	else if (v < -limit)
+		v = -limit;
+	*acc -= v << HID_MOUSE_WHEEL_RES_SHIFT;
+	return v;
+}
+#endif
+
+/* Sends the next queued button state along with
+ * as much of the accumulated motion as fits in one report.  Whatever does
+ * not fit is left for the next hid_tx_done. */
+static void hid_mouse_flush(void)
+{
+	int32_t limit;
+	int16_t x, y;
+#ifdef MOUSE_WHEEL
+	int16_t wheel = 0;
+#endif
+#ifdef MOUSE_PAN
+	int8_t pan = 0;
+#endif
+	if (mouse_state.tx_busy || hid_suspended || !(hid_configured & 2))
+		return;
+	limit = hid_info[1].hid_protocol ? MOUSE_REPORT_MAX : MOUSE_BOOT_MAX;
+	x = hid_mouse_take(&mouse_state.x, limit);
+	y = hid_mouse_take(&mouse_state.y, limit);
+	/* boot protocol has no wheel or pan, so those are dropped */
+#ifdef MOUSE_WHEEL
+	if (hid_info[1].hid_protocol == 0)
+		mouse_state.wheel = 0;
+	else
+		wheel = hid_mouse_take_scroll(&mouse_state.wheel, MOUSE_REPORT_MAX);
+#endif
+#ifdef MOUSE_PAN
+	if (hid_info[1].hid_protocol == 0)
+		mouse_state.pan = 0;
+	else
+		pan = hid_mouse_take_scroll(&mouse_state.pan, MOUSE_PAN_MAX);
+#endif
+	if (mouse_state.buttons_count)
+	{
+		mouse_hid_report.buttons = mouse_state.buttons[mouse_state.buttons_head];
+		mouse_state.buttons_head = (mouse_state.buttons_head + 1) % MOUSE_BUTTON_QUEUE_SIZE;
+		--mouse_state.buttons_count;
+	}
+	else if (x == 0 && y == 0
+#ifdef MOUSE_WHEEL
+		 && wheel == 0
+#endif
+#ifdef MOUSE_PAN
+		 && pan == 0
+#endif
+		)
+	{
+		/* nothing taken, less than a detent of scrolling stays put */
+		return;
+	}
 	mouse_hid_report.x = x;
 	mouse_hid_report.y = y;
-#if defined(MOUSE_WHEEL)
-	mouse_hid_report.wheel = 0;
+#ifdef MOUSE_WHEEL
+	mouse_hid_report.wheel = wheel;
 #endif
-#if defined(MOUSE_PAN)
-	mouse_hid_report.pan = 0;
+#ifdef MOUSE_PAN
+	mouse_hid_report.pan = pan;
 #endif
+	hid_report_queued(1, mouse_state.stamp);
+	mouse_state.pending = 0;
 	hid_mouse_write();
-	ret = 1;
-	chopstx_mutex_unlock(&hid_locks[1].tx_mut);
-	return ret;
+	mouse_state.tx_busy = 1;
 }
 
-int hid_mouse_set_buttons(uint8_t buttons)
+/* The most recent button state, sent or not */
+static uint8_t hid_mouse_last_buttons(void)
 {
-	int ret = 0;
-	buttons &= 0x7;
-	chopstx_mutex_lock(&hid_locks[1].tx_mut);
-	if (mouse_hid_report.buttons != buttons)
+	if (mouse_state.buttons_count == 0)
+		return mouse_hid_report.buttons;
+	return mouse_state.buttons[(mouse_state.buttons_head + mouse_state.buttons_count - 1) % MOUSE_BUTTON_QUEUE_SIZE];
+}
+
+static int hid_mouse_queue_buttons(uint8_t buttons)
+{
+	if (hid_mouse_last_buttons() == buttons)
+		return 0;
+	/* when full, the newest state is replaced */
+	if (mouse_state.buttons_count < MOUSE_BUTTON_QUEUE_SIZE)
+		++mouse_state.buttons_count;
+	mouse_state.buttons[(mouse_state.buttons_head + mouse_state.buttons_count - 1) % MOUSE_BUTTON_QUEUE_SIZE] = buttons;
+	return 1;
+}
+
+/* Mice merge by ORing their buttons */
+static int hid_mouse_port_buttons(uint8_t port, uint8_t buttons)
+{
+	uint8_t merged = 0;
+	mouse_state.port_buttons[port] = buttons;
+	for (int i = 0; i < INPUT_NUM_PORTS; ++i)
+		merged |= mouse_state.port_buttons[i];
+	return hid_mouse_queue_buttons(merged);
+}
+
+static void hid_mouse_stamp(uint32_t stamp)
+{
+	if (!mouse_state.pending)
 	{
-		mouse_hid_report.buttons = buttons;
-		mouse_hid_report.x = 0;
-		mouse_hid_report.y = 0;
-#if defined(MOUSE_WHEEL)
-		mouse_hid_report.wheel = 0;
-#endif
-#if defined(MOUSE_PAN)
-		mouse_hid_report.pan = 0;
-#endif
-		//hid_mouse_write();
-		ret = 1;
+		mouse_state.stamp = stamp;
+		mouse_state.pending = 1;
 	}
-	chopstx_mutex_unlock(&hid_locks[1].tx_mut);
-	return ret;
 }
 
-int hid_mouse_button_press(uint8_t button)
+/* One decoded packet: the new button state and its motion are applied
+ * together, and sent in one report when possible. */
+static int hid_mouse_update(uint8_t port, uint8_t buttons, int16_t x, int16_t y, int16_t wheel, int16_t pan, uint32_t stamp)
 {
 	int ret = 0;
-	uint8_t mask = 1 << button;
-	chopstx_mutex_lock(&hid_locks[1].tx_mut);
-	if (!(mouse_hid_report.buttons & mask))
-	{
-		mouse_hid_report.buttons |= mask;
-		mouse_hid_report.x = 0;
-		mouse_hid_report.y = 0;
-#if defined(MOUSE_WHEEL)
-		mouse_hid_report.wheel = 0;
+#if !defined(MOUSE_WHEEL)
+	(void)wheel;
 #endif
-#if defined(MOUSE_PAN)
-		mouse_hid_report.pan = 0;
+#if !defined(MOUSE_PAN)
+	(void)pan;
 #endif
-		hid_mouse_write();
-		ret = 1;
-	}
-	chopstx_mutex_unlock(&hid_locks[1].tx_mut);
+	buttons &= 0x7;
+	ret = hid_mouse_port_buttons(port, buttons);
+	hid_mouse_stamp(stamp);
+	mouse_state.x += x;
+	mouse_state.y += y;
+#ifdef MOUSE_WHEEL
+	mouse_state.wheel += wheel;
+#endif
+#ifdef MOUSE_PAN
+	mouse_state.pan += pan;
+#endif
+	hid_mouse_flush();
 	return ret;
 }
 
-int hid_mouse_button_release(uint8_t button)
+/* Stamped only when it changes the buttons, a report then goes out */
+static void hid_mouse_release(uint8_t port, uint32_t stamp)
 {
-	int ret = 0;
-	uint8_t mask = 1 << button;
-	chopstx_mutex_lock(&hid_locks[1].tx_mut);
-	if (mouse_hid_report.buttons & mask)
+	if (hid_mouse_port_buttons(port, 0))
 	{
-		mouse_hid_report.buttons &= ~mask;
-		mouse_hid_report.x = 0;
-		mouse_hid_report.y = 0;
-#if defined(MOUSE_WHEEL)
-		mouse_hid_report.wheel = 0;
-#endif
-#if defined(MOUSE_PAN)
-		mouse_hid_report.pan = 0;
-#endif
-		hid_mouse_write();
-		ret = 1;
+		hid_mouse_stamp(stamp);
+		hid_mouse_flush();
 	}
-	chopstx_mutex_unlock(&hid_locks[1].tx_mut);
-	return ret;
 }
 
 int hid_data_setup(struct usb_dev *dev, uint16_t interface)
@@ -368,19 +686,30 @@ int hid_data_setup(struct usb_dev *dev, uint16_t interface)
 		if (((dev->dev_req.value >> 8) & 0xFF) == 1)
 		{
 			int ret;
-			chopstx_mutex_lock(&hid_locks[interface - HID_INTERFACE_0].tx_mut);
 			if (interface == HID_INTERFACE_0)
 				ret = usb_lld_ctrl_send (dev, &keyb_hid_report, sizeof(keyb_hid_report));
+			else if (hid_info[1].hid_protocol == 0)
+			{
+				hid_mouse_boot_fill();
+				ret = usb_lld_ctrl_send (dev, &mouse_boot_report, sizeof(mouse_boot_report));
+			}
 			else /*if (interface == HID_INTERFACE_1)*/
 				ret = usb_lld_ctrl_send (dev, &mouse_hid_report, sizeof(mouse_hid_report));
-			chopstx_mutex_unlock(&hid_locks[interface - HID_INTERFACE_0].tx_mut);
 			return ret;
 		}
+#if defined(MOUSE_WHEEL) || defined(MOUSE_PAN)
+		if (((dev->dev_req.value >> 8) & 0xFF) == 3 && interface == HID_INTERFACE_1)
+			return usb_lld_ctrl_send (dev, &mouse_feature_report, sizeof(mouse_feature_report));
+#endif
 		return -1;
 
 	case USB_HID_REQ_SET_REPORT:
 		if (((dev->dev_req.value >> 8) & 0xFF) == 2 && interface == HID_INTERFACE_0)
 			return usb_lld_ctrl_recv (dev, &keyb_output_report, sizeof(keyb_output_report));
+#if defined(MOUSE_WHEEL) || defined(MOUSE_PAN)
+		if (((dev->dev_req.value >> 8) & 0xFF) == 3 && interface == HID_INTERFACE_1)
+			return usb_lld_ctrl_recv (dev, &mouse_feature_report, sizeof(mouse_feature_report));
+#endif
 		return -1;
 
 	case USB_HID_REQ_GET_PROTOCOL:
@@ -405,8 +734,105 @@ void hid_ctrl_write_finish(struct usb_dev *dev, uint16_t interface)
 	}
 }
 
+/* The report builder: everything in here runs on the USB thread, so
+ * the report state needs no locking. */
+/* Events are held in the ring only while the host is being woken, so
+ * that the keystroke which woke it still reaches it.  Otherwise they go
+ * into the report state, and resume sends just that. */
+static uint8_t hid_hold;
+static uint8_t hid_held;
+
+void hid_suspend(int hold)
+{
+	hid_suspended = 1;
+	hid_hold = hold;
+}
+
+void hid_resume(void)
+{
+	uint8_t buttons;
+	uint32_t now = timebase_now();
+	if (!hid_suspended)
+		return;
+	hid_suspended = 0;
+	hid_hold = 0;
+
+	keyb_state.count = 0;
+	hid_keyb_write(now);
+
+	/* motion from before the suspend is stale by now */
+	mouse_state.x = mouse_state.y = 0;
+#ifdef MOUSE_WHEEL
+	mouse_state.wheel = 0;
+#endif
+#ifdef MOUSE_PAN
+	mouse_state.pan = 0;
+#endif
+	buttons = hid_mouse_last_buttons();
+	mouse_state.buttons_count = 0;
+	mouse_state.pending = 0;
+	if (hid_mouse_queue_buttons(buttons))
+	{
+		hid_mouse_stamp(now);
+		hid_mouse_flush();
+	}
+}
+
+/* After a bus reset nothing goes out until the host configures the
+ * interfaces again, and what was queued is for the old configuration */
+void hid_reset(void)
+{
+	hid_suspended = 0;
+	hid_hold = 0;
+	hid_held = 0;
+	hid_configured = 0;
+	keyb_state.count = 0;
+	mouse_state.buttons_count = 0;
+}
+
+int hid_input_process(void)
+{
+	struct input_event ev;
+	int pending = input_event_pending();
+	if (!pending && !hid_held)
+		return 0;
+	if (hid_suspended && hid_hold)
+	{
+		hid_held = 1;
+		return pending;
+	}
+	hid_held = 0;
+	PROF_BEGIN(PROF_HID_INPUT);
+	while (input_event_get(&ev))
+	{
+		switch (ev.type)
+		{
+		case INPUT_EV_KEY_DOWN:
+		{
+			PROF_BEGIN(PROF_KEY_PRESSED);
+			hid_key_pressed(ev.port, ev.code, ev.stamp);
+			PROF_END(PROF_KEY_PRESSED);
+			break;
+		}
+		case INPUT_EV_KEY_UP:
+			hid_key_released(ev.port, ev.code, ev.stamp);
+			break;
+		case INPUT_EV_MOUSE:
+			hid_mouse_update(ev.port, ev.code, ev.x, ev.y, ev.wheel, ev.pan, ev.stamp);
+			break;
+		case INPUT_EV_KEY_RESET:
+			hid_key_releaseAll(ev.port, ev.stamp);
+			break;
+		case INPUT_EV_MOUSE_RESET:
+			hid_mouse_release(ev.port, ev.stamp);
+			break;
+		}
+	}
+	PROF_END(PROF_HID_INPUT);
+	return 0;
+}
+
 void hid_init(void)
 {
-	for (int i = 0; i < 2; ++i)
-		chopstx_mutex_init(&hid_locks[i].tx_mut);
+	input_event_init();
 }
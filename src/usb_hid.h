@@ -7,12 +7,43 @@ void hid_tx_done(uint8_t ep_num, uint16_t len);
 int hid_data_setup(struct usb_dev *dev, uint16_t interface);
 void hid_ctrl_write_finish(struct usb_dev *dev, uint16_t interface);
 void hid_init(void);
-int hid_key_pressed(uint8_t hidcode);
-int hid_key_released(uint8_t hidcode);
-int hid_key_releaseAll(void);
-int hid_mouse_move(int8_t x, int8_t y);
-/* XXX does not send, assume buttons are follwed immediately by move */
-int hid_mouse_set_buttons(uint8_t buttons);
-int hid_mouse_button_press(uint8_t button);
-int hid_mouse_button_release(uint8_t button);
+/* Log2 histograms of report latency in timebase microseconds.  Bucket 0
+ * counts 0, bucket n counts 2^(n-1) up to 2^n, and the last bucket
+ * everything from 2^19, about half a second, up.  queued is from the oldest input in a report
+ * arriving on the serial port to the report going to the endpoint, acked
+ * from there to the host taking it. */
+#define HID_LATENCY_BUCKETS 21
+
+struct hid_latency
+{
+	uint32_t queued[HID_LATENCY_BUCKETS];
+	uint32_t acked[HID_LATENCY_BUCKETS];
+};
+
+/* interface is HID_INTERFACE_0 or 1, NULL for anything else */
+struct hid_latency *hid_get_latency(uint16_t interface);
+void hid_reset_latency(void);
+
+/* With coalescing on, a keyboard report made while one is in flight
+ * only replaces the next to go, rather than queueing behind it */
+void hid_set_keyb_coalesce(int on);
+int hid_get_keyb_coalesce(void);
+
+/* Builds reports from the queued input events, on the USB thread.
+ * After hid_suspend with hold set the events are held, and it returns
+ * 1 when new ones came in, to wake the host.  Without it, or once
+ * suspended again with hold clear, they only update the reports, and
+ * hid_resume sends the current state.  hid_reset is for a bus reset,
+ * after it nothing is sent until the interfaces are configured. */
+int hid_input_process(void);
+void hid_suspend(int hold);
+void hid_resume(void);
+void hid_reset(void);
+
+#define HID_MOUSE_BUTTON_LEFT 0x01
+#define HID_MOUSE_BUTTON_RIGHT 0x02
+#define HID_MOUSE_BUTTON_MIDDLE 0x04
+
+/* Resolution Multiplier of 8, see mouse_report_desc */
+#define HID_MOUSE_WHEEL_RES_SHIFT 3
 
@@ -0,0 +1,167 @@
+/*
+ * dtrace-decode -- turn binary trace frames from the debug console
+ * back into text, see src/dtrace.h for the format.
+ *
+ *   cc -I../src -o dtrace-decode dtrace-decode.c
+ *   dtrace-decode [-c] [file]
+ *
+ * Reads the console stream from file, or stdin, and prints one line per
+ * frame with the time since boot in microseconds.  Text in the stream
+ * is passed through as it is.  With -c, frames come out as CSV,
+ *   time_us,event,port,byte0,byte1,...
+ * and text lines as time_us,text,"line".
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dtrace.h"
+
+static const char *const event_names[] = {
+  [DTRACE_MOUSE_BYTES] = "mouse_bytes",
+  [DTRACE_KEY_BYTES] = "key_bytes",
+  [DTRACE_MOUSE_RESYNC] = "mouse_resync",
+};
+#define NUM_EVENT_NAMES (sizeof (event_names) / sizeof (event_names[0]))
+
+static int csv;
+static uint64_t now;
+static char text[256];
+static size_t text_len;
+
+static void
+flush_text (void)
+{
+  size_t i;
+
+  if (text_len == 0)
+    return;
+  if (csv)
+    {
+      printf ("%llu,text,\"", (unsigned long long)now);
+      for (i = 0; i < text_len; i++)
+	{
+	  if (text[i] == '"')
+	    putchar ('"');
+	  putchar (text[i]);
+	}
+      printf ("\"\n");
+    }
+  else
+    printf ("%.*s\n", (int)text_len, text);
+  text_len = 0;
+}
+
+static void
+put_text (int c)
+{
+  if (c == '\n' || text_len == sizeof (text))
+    flush_text ();
+  if (c != '\n')
+    text[text_len++] = c;
+}
+
+/* Returns 0 at the end of the stream.  */
+static int
+get_varint (FILE *f, uint32_t *v)
+{
+  int shift = 0;
+  int c;
+
+  *v = 0;
+  while ((c = getc (f)) != EOF && shift < 35)
+    {
+      *v |= (uint32_t)(c & 0x7f) << shift;
+      shift += 7;
+      if ((c & 0x80) == 0)
+	return 1;
+    }
+  return 0;
+}
+
+static void
+print_frame (uint8_t header, const uint8_t *data, int count)
+{
+  uint8_t event = DTRACE_EVENT (header);
+  int i;
+
+  flush_text ();
+  if (csv)
+    {
+      if (event < NUM_EVENT_NAMES && event_names[event])
+	printf ("%llu,%s,%u", (unsigned long long)now, event_names[event],
+		DTRACE_DEV_NO (header));
+      else
+	printf ("%llu,%u,%u", (unsigned long long)now, event,
+		DTRACE_DEV_NO (header));
+      for (i = 0; i < count; i++)
+	printf (",%u", data[i]);
+      putchar ('\n');
+    }
+  else
+    {
+      printf ("%10llu.%03llu ms  ", (unsigned long long)(now / 1000),
+	      (unsigned long long)(now % 1000));
+      if (event < NUM_EVENT_NAMES && event_names[event])
+	printf ("%-14s", event_names[event]);
+      else
+	printf ("event%-9u", event);
+      printf (" port %u", DTRACE_DEV_NO (header));
+      for (i = 0; i < count; i++)
+	printf (" %02x", data[i]);
+      putchar ('\n');
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  FILE *f = stdin;
+  int c;
+
+  while ((c = getopt (argc, argv, "c")) != -1)
+    switch (c)
+      {
+      case 'c':
+	csv = 1;
+	break;
+      default:
+	fprintf (stderr, "Usage: %s [-c] [file]\n", argv[0]);
+	return 1;
+      }
+  if (optind < argc)
+    {
+      f = fopen (argv[optind], "rb");
+      if (f == NULL)
+	{
+	  perror (argv[optind]);
+	  return 1;
+	}
+    }
+
+  while ((c = getc (f)) != EOF)
+    {
+      uint8_t data[DTRACE_MAX_COUNT];
+      uint32_t delta;
+      int count;
+
+      if ((c & DTRACE_FRAME) == 0)
+	{
+	  if (c == '\n' || c == '\t' || (c >= 0x20 && c < 0x7f))
+	    put_text (c);
+	  continue;
+	}
+      if (!get_varint (f, &delta))
+	break;
+      now += delta;
+      count = DTRACE_COUNT (c);
+      if (fread (data, 1, count, f) != (size_t)count)
+	break;
+      print_frame (c, data, count);
+      fflush (stdout);
+    }
+  flush_text ();
+  return 0;
+}